@@ -1,14 +1,25 @@
 #include "FormulaAST.h"
+#include "snapshot.h"
 
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <istream>
+#include <iterator>
 #include <memory>
 #include <optional>
-#include <sstream>
+#include <ostream>
+#include <string>
 
 namespace ASTImpl {
 
@@ -67,32 +78,349 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Fixed-size scratch array of doubles that stays on the stack
+// for typical formulas and falls back to the heap for huge ones.
+class LocalBuffer {
+public:
+    explicit LocalBuffer(size_t size)
+        : data_(local_) {
+        if (size > INLINE_SIZE) {
+            heap_ = std::make_unique<double[]>(size);
+            data_ = heap_.get();
+        }
+    }
+
+    double* data() {
+        return data_;
+    }
+
+    double& operator[](size_t index) {
+        return data_[index];
+    }
+
+private:
+    static constexpr size_t INLINE_SIZE = 32;
+
+    double local_[INLINE_SIZE];
+    std::unique_ptr<double[]> heap_;
+    double* data_;
+};
+
+inline double CheckFinite(double value) {
+    if (!std::isfinite(value)) {
+        throw FormulaError(FormulaError::Category::Div0);
+    }
+    return value;
+}
+
+struct FunctionName {
+    std::string_view name;
+    Function function;
+};
+
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {"SUM", Function::Sum},
+    {"AVERAGE", Function::Average},
+    {"MIN", Function::Min},
+    {"MAX", Function::Max},
+    {"COUNT", Function::Count},
+};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.name == name) {
+            return entry.function;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view GetFunctionName(Function function) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.function == function) {
+            return entry.name;
+        }
+    }
+    assert(false);
+    return {};
+}
+
+// Empty cells of the ranges are skipped, and so are plain cell arguments,
+// which are read as one-cell ranges. MIN and MAX of no values are 0,
+// AVERAGE of no values is a division by zero.
+double CallFunction(const Call& call, const double* values, ArenaSpan<Rect> ranges,
+                    const SheetArgs& args, Position shift) {
+    RangeAccumulator accumulator(call.function == Function::Count);
+    accumulator.Add(values, call.arg_count);
+    for (std::uint32_t i = call.first_range; i < call.first_range + call.range_count; ++i) {
+        const Rect range = ShiftRect(ranges[i], shift);
+        if (!range.IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        args.ReadRange(range, accumulator);
+    }
+
+    const RangeAccumulator::Totals& totals = accumulator.Finish();
+    switch (call.function) {
+        case Function::Sum:
+            return CheckFinite(totals.sum);
+        case Function::Average:
+            return CheckFinite(totals.sum / static_cast<double>(totals.count));
+        case Function::Min:
+            return totals.count == 0 ? 0.0 : totals.min;
+        case Function::Max:
+            return totals.count == 0 ? 0.0 : totals.max;
+        case Function::Count:
+            return static_cast<double>(totals.count);
+    }
+    assert(false);
+    return 0;
+}
+
+// Sorted indices of the cells read by Cell instructions of code,
+// the operands must be less than cell_count
+ArenaSpan<std::uint32_t> CollectReadCells(ArenaSpan<Instruction> code, size_t cell_count,
+                                          Arena& arena) {
+    std::vector<bool> read(cell_count);
+    for (const Instruction& instr : code) {
+        if (instr.op == OpCode::Cell) {
+            read[instr.operand] = true;
+        }
+    }
+    std::vector<std::uint32_t> indices;
+    for (size_t i = 0; i < cell_count; ++i) {
+        if (read[i]) {
+            indices.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+    return arena.CopyArray(indices.data(), indices.size());
+}
+
+// Emits instructions in postfix order and keeps track of the stack depth
+// the program needs.
+class ProgramBuilder {
+public:
+    explicit ProgramBuilder(ArenaSpan<Position> cells)
+        : cells_(cells) {
+    }
+
+    void PushNumber(double value) {
+        constants_.push_back(value);
+        Emit(OpCode::Number, static_cast<std::uint32_t>(constants_.size() - 1), 1);
+    }
+
+    void PushCell(Position cell) {
+        auto it = std::lower_bound(cells_.begin(), cells_.end(), cell);
+        assert(it != cells_.end() && *it == cell);
+        Emit(OpCode::Cell, static_cast<std::uint32_t>(it - cells_.begin()), 1);
+    }
+
+    void ApplyBinary(OpCode op) {
+        Emit(op, 0, -1);
+    }
+
+    void ApplyUnary(OpCode op) {
+        Emit(op, 0, 0);
+    }
+
+    // A call is compiled as BeginCall(), then BeginArgument() and the code of
+    // each argument, then ApplyCall(). Arguments leave their values on the
+    // stack, ranges are collected by PushRange() and stay with the innermost
+    // open call. An argument that is a plain cell reference becomes a
+    // one-cell range, so that a cell counts the same in SUM(A1) and
+    // SUM(A1:A1) whether it is empty, text or an error.
+    void BeginCall() {
+        open_calls_.push_back({depth_, pending_ranges_.size(), code_.size()});
+    }
+
+    void BeginArgument() {
+        assert(!open_calls_.empty());
+        FinishArgument();
+        open_calls_.back().argument_start = code_.size();
+    }
+
+    void PushRange(Rect range) {
+        pending_ranges_.push_back(range);
+    }
+
+    void ApplyCall(Function function) {
+        assert(!open_calls_.empty());
+        FinishArgument();
+        const CallStart start = open_calls_.back();
+        open_calls_.pop_back();
+        Call call;
+        call.function = function;
+        call.arg_count = static_cast<std::uint32_t>(depth_ - start.depth);
+        call.first_range = static_cast<std::uint32_t>(call_ranges_.size());
+        call.range_count = static_cast<std::uint32_t>(pending_ranges_.size() - start.pending_ranges);
+        call_ranges_.insert(call_ranges_.end(), pending_ranges_.begin() + start.pending_ranges,
+                            pending_ranges_.end());
+        pending_ranges_.resize(start.pending_ranges);
+
+        calls_.push_back(call);
+        Emit(OpCode::Call, static_cast<std::uint32_t>(calls_.size() - 1),
+             1 - static_cast<int>(call.arg_count));
+    }
+
+    // copies the program into arena
+    Program Build(Arena& arena) {
+        assert(depth_ == 1);
+        Program program;
+        program.code = arena.CopyArray(code_.data(), code_.size());
+        program.read_cells = CollectReadCells(program.code, cells_.size(), arena);
+        program.constants = arena.CopyArray(constants_.data(), constants_.size());
+        program.calls = arena.CopyArray(calls_.data(), calls_.size());
+        program.call_ranges = arena.CopyArray(call_ranges_.data(), call_ranges_.size());
+        program.max_stack_depth = max_stack_depth_;
+        return program;
+    }
+
+private:
+    struct CallStart {
+        size_t depth;
+        size_t pending_ranges;
+        // code of the current argument starts here
+        size_t argument_start;
+    };
+
+    // turns the argument that has just been compiled into a one-cell range
+    // if it is a plain cell reference
+    void FinishArgument() {
+        const CallStart& start = open_calls_.back();
+        if (code_.size() != start.argument_start + 1 || code_.back().op != OpCode::Cell) {
+            return;
+        }
+        const Position cell = cells_[code_.back().operand];
+        code_.pop_back();
+        --depth_;
+        pending_ranges_.push_back({cell, cell});
+    }
+
+    void Emit(OpCode op, std::uint32_t operand, int stack_effect) {
+        code_.push_back({op, operand});
+        depth_ += stack_effect;
+        max_stack_depth_ = std::max(max_stack_depth_, depth_);
+    }
+
+    ArenaSpan<Position> cells_;
+    std::vector<Instruction> code_;
+    std::vector<double> constants_;
+    std::vector<Call> calls_;
+    std::vector<Rect> call_ranges_;
+    std::vector<Rect> pending_ranges_;
+    std::vector<CallStart> open_calls_;
+    size_t depth_ = 0;
+    size_t max_stack_depth_ = 0;
+};
+
+// Node kinds in a saved tree, see FormulaAST::Save()
+enum class NodeKind : std::uint8_t {
+    Number,
+    Cell,
+    Range,
+    Unary,
+    Binary,
+    Function,
+};
+
+void SavePosition(SnapshotWriter& out, Position pos) {
+    out.Write<std::int32_t>(pos.row);
+    out.Write<std::int32_t>(pos.col);
+}
+
+Position LoadPosition(SnapshotReader& in) {
+    Position pos;
+    pos.row = in.Read<std::int32_t>();
+    pos.col = in.Read<std::int32_t>();
+    return pos;
+}
+
+void SaveRect(SnapshotWriter& out, Rect rect) {
+    SavePosition(out, rect.top_left);
+    SavePosition(out, rect.bottom_right);
+}
+
+Rect LoadRect(SnapshotReader& in) {
+    Rect rect;
+    rect.top_left = LoadPosition(in);
+    rect.bottom_right = LoadPosition(in);
+    return rect;
+}
+
+// Nodes live in the arena of their FormulaAST and are never destroyed,
+// so they must stay trivially destructible and refer to each other
+// with plain pointers.
+//
+// Trees are walked without recursion, see WalkTree(): a long sum parses
+// into a tree as deep as the number of its terms. A node takes part in a
+// walk through a step function called with step = 0, 1, ... Each call does
+// the node's work that comes before its child number step and returns that
+// child; the call after the last child finishes the node and returns nullptr.
 class Expr {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetArgs& args) const = 0;
+    virtual const Expr* PrintStep(std::ostream& out, size_t step) const = 0;
+    // parentheses around the node are printed by the walk, references are
+    // printed moved by shift, see FormulaAST::PrintFormula()
+    virtual const Expr* PrintFormulaStep(std::ostream& out, size_t step,
+                                         Position shift) const = 0;
+    virtual const Expr* CompileStep(ProgramBuilder& builder, size_t step) const = 0;
+    // writes the subtree in postfix order: children first, then the node
+    virtual const Expr* SaveStep(SnapshotWriter& out, size_t step) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
+    // whether the node needs parentheses as the child number index of parent
+    bool NeedsParens(const Expr* parent, size_t index) const {
+        if (parent == nullptr) {
+            return false;
         }
+        // only the right operand of a binary operator has index 1; function
+        // arguments are atoms for the rules and never need parentheses
+        const auto mask = index == 1 ? PR_RIGHT : PR_LEFT;
+        return PRECEDENCE_RULES[parent->GetPrecedence()][GetPrecedence()] & mask;
+    }
 
-        DoPrintFormula(out, precedence);
+protected:
+    ~Expr() = default;
+};
 
-        if (parens_needed) {
-            out << ')';
+// Walks the tree under root with an explicit stack: step(node, i) is called
+// for i = 0, 1, ... until it returns nullptr, and every child it returns is
+// walked completely before the next call. enter(node, parent, index) and
+// leave(node, parent, index) are called around the steps of each node,
+// index is the step that returned it.
+template <typename Step, typename Enter, typename Leave>
+void WalkTree(const Expr* root, Step step, Enter enter, Leave leave) {
+    struct Frame {
+        const Expr* node;
+        size_t next_step;
+    };
+    std::vector<Frame> frames;
+    enter(root, nullptr, 0);
+    frames.push_back({root, 0});
+    while (!frames.empty()) {
+        const size_t index = frames.back().next_step++;
+        const Expr* node = frames.back().node;
+        if (const Expr* child = step(node, index)) {
+            enter(child, node, index);
+            frames.push_back({child, 0});
+            continue;
+        }
+        frames.pop_back();
+        if (frames.empty()) {
+            leave(node, nullptr, 0);
+        } else {
+            leave(node, frames.back().node, frames.back().next_step - 1);
         }
     }
-};
+}
+
+template <typename Step>
+void WalkTree(const Expr* root, Step step) {
+    const auto skip = [](const Expr*, const Expr*, size_t) {};
+    WalkTree(root, step, skip, skip);
+}
 
 namespace {
 class BinaryOpExpr final : public Expr {
@@ -105,24 +433,37 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
+    const Expr* PrintStep(std::ostream& out, size_t step) const override {
+        switch (step) {
+            case 0:
+                out << '(' << static_cast<char>(type_) << ' ';
+                return lhs_;
+            case 1:
+                out << ' ';
+                return rhs_;
+            default:
+                out << ')';
+                return nullptr;
+        }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    const Expr* PrintFormulaStep(std::ostream& out, size_t step,
+                                 Position /* shift */) const override {
+        switch (step) {
+            case 0:
+                return lhs_;
+            case 1:
+                out << static_cast<char>(type_);
+                return rhs_;
+            default:
+                return nullptr;
+        }
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,33 +483,45 @@ public:
         }
     }
 
-    double Evaluate(const SheetArgs& args) const override {
-        double result = 0.0;
-        switch (type_){
-        case Add:
-            result = lhs_->Evaluate(args) + rhs_->Evaluate(args);
-        break;
-        case Subtract:
-            result = lhs_->Evaluate(args) - rhs_->Evaluate(args);
-        break;
-        case Multiply:
-            result = lhs_->Evaluate(args) * rhs_->Evaluate(args);
-        break   ;
-        case Divide: {
-			result = lhs_->Evaluate(args) / rhs_->Evaluate(args);
+    const Expr* CompileStep(ProgramBuilder& builder, size_t step) const override {
+        if (const Expr* operand = GetOperand(step)) {
+            return operand;
+        }
+        switch (type_) {
+            case Add:
+                builder.ApplyBinary(OpCode::Add);
+                break;
+            case Subtract:
+                builder.ApplyBinary(OpCode::Subtract);
+                break;
+            case Multiply:
+                builder.ApplyBinary(OpCode::Multiply);
+                break;
+            case Divide:
+                builder.ApplyBinary(OpCode::Divide);
+                break;
         }
-        break;
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t step) const override {
+        if (const Expr* operand = GetOperand(step)) {
+            return operand;
         }
-			if (!std::isfinite(result)) {
-				throw FormulaError(FormulaError::Category::Div0);
-			}
-        return result;
+        out.Write(NodeKind::Binary);
+        out.Write(static_cast<char>(type_));
+        return nullptr;
     }
 
 private:
+    // lhs for step 0, rhs for step 1, nullptr after them
+    const Expr* GetOperand(size_t step) const {
+        return step == 0 ? lhs_ : step == 1 ? rhs_ : nullptr;
+    }
+
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -179,63 +532,97 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
+    const Expr* PrintStep(std::ostream& out, size_t step) const override {
+        if (step == 0) {
+            out << '(' << static_cast<char>(type_) << ' ';
+            return operand_;
+        }
         out << ')';
+        return nullptr;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+    const Expr* PrintFormulaStep(std::ostream& out, size_t step,
+                                 Position /* shift */) const override {
+        if (step == 0) {
+            out << static_cast<char>(type_);
+            return operand_;
+        }
+        return nullptr;
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetArgs& args) const override {
-        return type_ == UnaryPlus ? operand_->Evaluate(args) : operand_->Evaluate(args) * -1;
+    const Expr* CompileStep(ProgramBuilder& builder, size_t step) const override {
+        if (step == 0) {
+            return operand_;
+        }
+        builder.ApplyUnary(type_ == UnaryPlus ? OpCode::UnaryPlus : OpCode::UnaryMinus);
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t step) const override {
+        if (step == 0) {
+            return operand_;
+        }
+        out.Write(NodeKind::Unary);
+        out.Write(static_cast<char>(type_));
+        return nullptr;
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(Position cell)
         : cell_(cell) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+    const Expr* PrintStep(std::ostream& out, size_t /* step */) const override {
+        PrintCell(out, cell_);
+        return nullptr;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    const Expr* PrintFormulaStep(std::ostream& out, size_t /* step */,
+                                 Position shift) const override {
+        PrintCell(out, ShiftPosition(cell_, shift));
+        return nullptr;
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetArgs& args) const override {
-        return args(*cell_);
+    const Expr* CompileStep(ProgramBuilder& builder, size_t /* step */) const override {
+        builder.PushCell(cell_);
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t /* step */) const override {
+        out.Write(NodeKind::Cell);
+        SavePosition(out, cell_);
+        return nullptr;
     }
 
 private:
-    const Position* cell_;
+    static void PrintCell(std::ostream& out, Position cell) {
+        if (!cell.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << cell.ToString();
+        }
+    }
+
+    Position cell_;
 };
 
 class NumberExpr final : public Expr {
@@ -244,45 +631,610 @@ public:
         : value_(value) {
     }
 
-    void Print(std::ostream& out) const override {
+    const Expr* PrintStep(std::ostream& out, size_t /* step */) const override {
         out << value_;
+        return nullptr;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    const Expr* PrintFormulaStep(std::ostream& out, size_t /* step */,
+                                 Position /* shift */) const override {
         out << value_;
+        return nullptr;
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetArgs& args) const override {
-        return value_;
+    const Expr* CompileStep(ProgramBuilder& builder, size_t /* step */) const override {
+        builder.PushNumber(value_);
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t /* step */) const override {
+        out.Write(NodeKind::Number);
+        out.Write(value_);
+        return nullptr;
     }
 
 private:
     double value_;
 };
 
+// A range argument of a function. It is not a value by itself,
+// compiling it only attaches the range to the enclosing call.
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(Rect range)
+        : range_(range) {
+    }
+
+    const Expr* PrintStep(std::ostream& out, size_t /* step */) const override {
+        out << range_.ToString();
+        return nullptr;
+    }
+
+    const Expr* PrintFormulaStep(std::ostream& out, size_t /* step */,
+                                 Position shift) const override {
+        out << ShiftRect(range_, shift).ToString();
+        return nullptr;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    const Expr* CompileStep(ProgramBuilder& builder, size_t /* step */) const override {
+        builder.PushRange(range_);
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t /* step */) const override {
+        out.Write(NodeKind::Range);
+        SaveRect(out, range_);
+        return nullptr;
+    }
+
+private:
+    Rect range_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    FunctionExpr(Function function, ArenaSpan<const Expr*> args)
+        : function_(function)
+        , args_(args) {
+    }
+
+    const Expr* PrintStep(std::ostream& out, size_t step) const override {
+        if (step == 0) {
+            out << '(' << GetFunctionName(function_);
+        }
+        if (step < args_.size()) {
+            out << ' ';
+            return args_[step];
+        }
+        out << ')';
+        return nullptr;
+    }
+
+    const Expr* PrintFormulaStep(std::ostream& out, size_t step,
+                                 Position /* shift */) const override {
+        if (step == 0) {
+            out << GetFunctionName(function_) << '(';
+        } else if (step < args_.size()) {
+            out << ',';
+        }
+        if (step < args_.size()) {
+            return args_[step];
+        }
+        out << ')';
+        return nullptr;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    const Expr* CompileStep(ProgramBuilder& builder, size_t step) const override {
+        if (step == 0) {
+            builder.BeginCall();
+        }
+        if (step < args_.size()) {
+            builder.BeginArgument();
+            return args_[step];
+        }
+        builder.ApplyCall(function_);
+        return nullptr;
+    }
+
+    const Expr* SaveStep(SnapshotWriter& out, size_t step) const override {
+        if (step < args_.size()) {
+            return args_[step];
+        }
+        out.Write(NodeKind::Function);
+        out.Write(function_);
+        out.Write(static_cast<std::uint32_t>(args_.size()));
+        return nullptr;
+    }
+
+private:
+    Function function_;
+    ArenaSpan<const Expr*> args_;
+};
+
+// Converts the text of a NUMBER token the way istream >> double does:
+// a value too large for double is an error, a value too small
+// to be represented becomes zero.
+double ParseNumber(std::string_view text) {
+    double value = 0;
+    const char* end = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (ec == std::errc::result_out_of_range && ptr == end) {
+        value = std::strtod(std::string(text).c_str(), nullptr);
+        ec = std::isinf(value) ? ec : std::errc();
+    }
+    if (ec != std::errc() || ptr != end) {
+        throw ParsingError("Invalid number: " + std::string(text));
+    }
+    return value;
+}
+
+// Splits formula text into the tokens of Formula.g4. Follows the longest match
+// rule of the generated lexer, tokens are views into the source text.
+class Tokenizer {
+public:
+    enum class TokenType {
+        Number,
+        Cell,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Comma,
+        Colon,
+        Name,
+        End,
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    explicit Tokenizer(std::string_view text)
+        : text_(text) {
+    }
+
+    // throws ParsingError on a character that does not start a token
+    Token Next() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return {TokenType::End, {}};
+        }
+
+        const size_t begin = pos_;
+        size_t end = begin + 1;
+        TokenType type;
+        switch (text_[begin]) {
+            case '+':
+                type = TokenType::Add;
+                break;
+            case '-':
+                type = TokenType::Sub;
+                break;
+            case '*':
+                type = TokenType::Mul;
+                break;
+            case '/':
+                type = TokenType::Div;
+                break;
+            case '(':
+                type = TokenType::LeftParen;
+                break;
+            case ')':
+                type = TokenType::RightParen;
+                break;
+            case ',':
+                type = TokenType::Comma;
+                break;
+            case ':':
+                type = TokenType::Colon;
+                break;
+            default:
+                if (IsUpper(text_[begin])) {
+                    end = LexCellOrName(begin, type);
+                } else {
+                    type = TokenType::Number;
+                    end = LexNumber(begin);
+                }
+                if (end == begin) {
+                    throw ParsingError("Error when lexing: token recognition error at: '"
+                                       + std::string(text_.substr(begin, 1)) + "'");
+                }
+        }
+        pos_ = end;
+        return {type, text_.substr(begin, end - begin)};
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < text_.size() && IsDigit(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t LexNumber(size_t pos) const {
+        size_t end = SkipDigits(pos);
+        if (end + 1 < text_.size() && text_[end] == '.' && IsDigit(text_[end + 1])) {
+            end = SkipDigits(end + 1);
+        }
+        if (end == pos) {
+            return pos;
+        }
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                end = SkipDigits(exponent);
+            }
+        }
+        return end;
+    }
+
+    // CELL : [A-Z]+[0-9]+ ;  NAME : [A-Z]+ ;
+    size_t LexCellOrName(size_t pos, TokenType& type) const {
+        size_t end = pos;
+        while (end < text_.size() && IsUpper(text_[end])) {
+            ++end;
+        }
+        const size_t digits_end = SkipDigits(end);
+        type = digits_end == end ? TokenType::Name : TokenType::Cell;
+        return digits_end;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+// Operator precedence parser for the grammar in Formula.g4. Pending
+// operators and open parentheses and calls are kept on explicit stacks
+// rather than on the call stack, so formulas of any nesting depth parse,
+// and the trees are the same as a recursive descent would build. Syntax
+// errors are reported as ParsingError and references to cells outside the
+// sheet as FormulaException, like ParseASTListener does.
+class HandWrittenParser {
+public:
+    explicit HandWrittenParser(std::string_view text)
+        : tokenizer_(text)
+        , arena_(ARENA_BYTES_PER_CHAR * text.size()) {
+        Advance();
+    }
+
+    FormulaAST Parse() {
+        // an operand is expected at the start and after an operator, an
+        // opening parenthesis or a comma
+        bool expect_operand = true;
+        for (;;) {
+            if (expect_operand) {
+                expect_operand = ParseOperandToken();
+            } else if (const int precedence = GetBinaryPrecedence(token_.type);
+                       precedence > 0 && !after_range_) {
+                ReduceOperators(precedence);
+                operators_.push_back({token_.type, precedence});
+                Advance();
+                expect_operand = true;
+            } else if (token_.type == TokenType::RightParen && !groups_.empty()) {
+                CloseGroup();
+            } else if (token_.type == TokenType::Comma && !groups_.empty()
+                       && groups_.back().function) {
+                ReduceOperators(1);
+                Advance();
+                expect_operand = StartArgument();
+            } else {
+                break;
+            }
+        }
+        if (!groups_.empty() || token_.type != TokenType::End) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        ReduceOperators(1);
+        assert(operands_.size() == 1 && operators_.empty());
+        const Expr* root = operands_.back();
+
+        // syntax errors take precedence, as the listener only runs on a complete tree
+        if (invalid_.type == TokenType::Number) {
+            throw ParsingError("Invalid number: " + std::string(invalid_.text));
+        }
+        if (invalid_.type == TokenType::Cell) {
+            throw FormulaException("Invalid position: " + std::string(invalid_.text));
+        }
+        if (invalid_.type == TokenType::Name) {
+            throw FormulaException("Unknown function: " + std::string(invalid_.text));
+        }
+        return FormulaAST(std::move(arena_), root, std::move(cells_), std::move(ranges_));
+    }
+
+private:
+    using TokenType = Tokenizer::TokenType;
+    using Token = Tokenizer::Token;
+
+    // The first block of the arena is guessed from the length of the text.
+    // Measured formulas of up to a few dozen characters take 10 to 24 bytes
+    // per character, so they fit into one block. The arena caps its blocks,
+    // so a long formula grows block by block instead of reserving all of
+    // this up front.
+    static constexpr size_t ARENA_BYTES_PER_CHAR = 24;
+
+    void Advance() {
+        token_ = tokenizer_.Next();
+    }
+
+    Token PeekNext() const {
+        Tokenizer tokenizer = tokenizer_;
+        return tokenizer.Next();
+    }
+
+    void Expect(TokenType type) {
+        if (token_.type != type) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        Advance();
+    }
+
+    // binding power of a binary operator, 0 for any other token
+    static int GetBinaryPrecedence(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+            case TokenType::Sub:
+                return 1;
+            case TokenType::Mul:
+            case TokenType::Div:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    static BinaryOpExpr::Type GetBinaryType(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+                return BinaryOpExpr::Add;
+            case TokenType::Sub:
+                return BinaryOpExpr::Subtract;
+            case TokenType::Mul:
+                return BinaryOpExpr::Multiply;
+            default:
+                assert(type == TokenType::Div);
+                return BinaryOpExpr::Divide;
+        }
+    }
+
+    static UnaryOpExpr::Type GetUnaryType(TokenType type) {
+        return type == TokenType::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+    }
+
+    // An operator waiting for its right operand. A sign applies to the
+    // operand right after it: -A1*B1 is (-A1)*B1.
+    struct PendingOperator {
+        TokenType type;
+        // binding power of a binary operator, 0 for a sign
+        int precedence;
+    };
+
+    // an open parenthesis or function call
+    struct Group {
+        // the name of the function, empty for a parenthesis
+        std::optional<Token> function;
+        // operands and operators before the group, the group does not touch them
+        size_t first_operand;
+        size_t first_operator;
+    };
+
+    size_t GetOperatorFloor() const {
+        return groups_.empty() ? 0 : groups_.back().first_operator;
+    }
+
+    // Handles a token where an operand is expected. Returns true while an
+    // operand is still expected: after a sign or an opening parenthesis.
+    bool ParseOperandToken() {
+        switch (token_.type) {
+            case TokenType::Add:
+            case TokenType::Sub:
+                operators_.push_back({token_.type, 0});
+                Advance();
+                return true;
+            case TokenType::LeftParen:
+                Advance();
+                groups_.push_back({std::nullopt, operands_.size(), operators_.size()});
+                return true;
+            case TokenType::Name: {
+                // NAME '(' arg (',' arg)* ')'
+                const Token name = token_;
+                Advance();
+                Expect(TokenType::LeftParen);
+                groups_.push_back({name, operands_.size(), operators_.size()});
+                return StartArgument();
+            }
+            case TokenType::Number: {
+                double value = 0;
+                try {
+                    value = ParseNumber(token_.text);
+                } catch (const ParsingError&) {
+                    SetInvalid(token_);
+                }
+                Advance();
+                FinishOperand(arena_.Make<NumberExpr>(value));
+                return false;
+            }
+            case TokenType::Cell: {
+                const auto cell = Position::FromString(token_.text);
+                if (!cell.IsValid()) {
+                    SetInvalid(token_);
+                } else {
+                    cells_.push_back(cell);
+                }
+                Advance();
+                FinishOperand(arena_.Make<CellExpr>(cell));
+                return false;
+            }
+            default:
+                throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+    }
+
+    // Pushes a complete operand, applying the signs written right before it
+    void FinishOperand(const Expr* operand) {
+        const size_t floor = GetOperatorFloor();
+        while (operators_.size() > floor && operators_.back().precedence == 0) {
+            operand = arena_.Make<UnaryOpExpr>(GetUnaryType(operators_.back().type), operand);
+            operators_.pop_back();
+        }
+        operands_.push_back(operand);
+    }
+
+    // Applies the binary operators of the innermost group binding at least
+    // as tight as min_precedence, left to right
+    void ReduceOperators(int min_precedence) {
+        const size_t floor = GetOperatorFloor();
+        while (operators_.size() > floor && operators_.back().precedence >= min_precedence) {
+            const auto type = GetBinaryType(operators_.back().type);
+            operators_.pop_back();
+            const Expr* rhs = operands_.back();
+            operands_.pop_back();
+            operands_.back() = arena_.Make<BinaryOpExpr>(type, operands_.back(), rhs);
+        }
+    }
+
+    // Starts an argument of a call: CELL ':' CELL | expr. Returns false if
+    // the argument is a range, which is complete by itself.
+    bool StartArgument() {
+        after_range_ = false;
+        if (token_.type != TokenType::Cell || PeekNext().type != TokenType::Colon) {
+            return true;
+        }
+
+        const Token first = token_;
+        Advance();
+        Advance();
+        if (token_.type != TokenType::Cell) {
+            throw ParsingError("Error when parsing: " + std::string(token_.text));
+        }
+        const Token last = token_;
+        Advance();
+
+        const auto first_cell = Position::FromString(first.text);
+        const auto last_cell = Position::FromString(last.text);
+        if (!first_cell.IsValid()) {
+            SetInvalid(first);
+        }
+        if (!last_cell.IsValid()) {
+            SetInvalid(last);
+        }
+        const Rect range = Rect::FromCorners(first_cell, last_cell);
+        if (range.IsValid()) {
+            ranges_.push_back(range);
+        }
+        operands_.push_back(arena_.Make<RangeExpr>(range));
+        // only ',' or ')' may follow a range
+        after_range_ = true;
+        return false;
+    }
+
+    // Closes the innermost parenthesis or call on ')'
+    void CloseGroup() {
+        ReduceOperators(1);
+        const Group group = groups_.back();
+        groups_.pop_back();
+        Advance();
+        after_range_ = false;
+        if (!group.function) {
+            const Expr* expr = operands_.back();
+            operands_.pop_back();
+            FinishOperand(expr);
+            return;
+        }
+
+        // the listener checks the name after the arguments
+        const auto function = FindFunction(group.function->text);
+        if (!function) {
+            SetInvalid(*group.function);
+        }
+        const auto args = arena_.CopyArray(operands_.data() + group.first_operand,
+                                           operands_.size() - group.first_operand);
+        operands_.resize(group.first_operand);
+        FinishOperand(arena_.Make<FunctionExpr>(function.value_or(Function::Sum), args));
+    }
+
+    void SetInvalid(const Token& token) {
+        if (invalid_.type == TokenType::End) {
+            invalid_ = token;
+        }
+    }
+
+    Tokenizer tokenizer_;
+    Token token_;
+    Arena arena_;
+    std::vector<Position> cells_;
+    std::vector<Rect> ranges_;
+    // the first literal that cannot be converted, End if there is none
+    Token invalid_;
+    // finished subtrees, pending operators and open groups
+    std::vector<const Expr*> operands_;
+    std::vector<PendingOperator> operators_;
+    std::vector<Group> groups_;
+    // the last argument was a range
+    bool after_range_ = false;
+};
+
+#ifdef SPREADSHEET_WITH_ANTLR
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    const Expr* MoveRoot() {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
+        const Expr* root = args_.front();
         args_.clear();
 
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    Arena MoveArena() {
+        return std::move(arena_);
+    }
+
+    std::vector<Position> MoveCells() {
         return std::move(cells_);
     }
 
+    std::vector<Rect> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        const Expr* operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -292,21 +1244,12 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
-
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(
+            arena_.Make<NumberExpr>(ParseNumber(ctx->NUMBER()->getSymbol()->getText())));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -316,18 +1259,49 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        cells_.push_back(value);
+        args_.push_back(arena_.Make<CellExpr>(value));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        const auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        const auto last_str = ctx->CELL(1)->getSymbol()->getText();
+        const auto first = Position::FromString(first_str);
+        if (!first.IsValid()) {
+            throw FormulaException("Invalid position: " + first_str);
+        }
+        const auto last = Position::FromString(last_str);
+        if (!last.IsValid()) {
+            throw FormulaException("Invalid position: " + last_str);
+        }
+
+        const Rect range = Rect::FromCorners(first, last);
+        ranges_.push_back(range);
+        args_.push_back(arena_.Make<RangeExpr>(range));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+
+        const auto name = ctx->NAME()->getSymbol()->getText();
+        const auto function = FindFunction(name);
+        if (!function) {
+            throw FormulaException("Unknown function: " + name);
+        }
+
+        const auto args = arena_.CopyArray(args_.data() + args_.size() - arg_count, arg_count);
+        args_.resize(args_.size() - arg_count);
+        args_.push_back(arena_.Make<FunctionExpr>(*function, args));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        const Expr* rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        const Expr* lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -341,8 +1315,7 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -350,8 +1323,10 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    Arena arena_;
+    std::vector<const Expr*> args_;
+    std::vector<Position> cells_;
+    std::vector<Rect> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -363,14 +1338,173 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+#endif
+
+std::atomic<FormulaParserKind> formula_parser = FormulaParserKind::HandWritten;
+
+// Rebuilds a tree saved by Expr::SaveStep() in arena. Nodes come in postfix
+// order, so a stack of finished subtrees is enough, no recursion is needed.
+const Expr* LoadTree(std::string_view data, Arena& arena) {
+    const auto malformed = [] {
+        return SnapshotError("malformed formula tree");
+    };
+    SnapshotReader in(data);
+    std::vector<const Expr*> stack;
+    const auto pop = [&]() {
+        if (stack.empty()) {
+            throw malformed();
+        }
+        const Expr* expr = stack.back();
+        stack.pop_back();
+        return expr;
+    };
+
+    while (!in.AtEnd()) {
+        switch (static_cast<NodeKind>(in.Read<std::uint8_t>())) {
+            case NodeKind::Number:
+                stack.push_back(arena.Make<NumberExpr>(in.Read<double>()));
+                break;
+            case NodeKind::Cell:
+                stack.push_back(arena.Make<CellExpr>(LoadPosition(in)));
+                break;
+            case NodeKind::Range:
+                stack.push_back(arena.Make<RangeExpr>(LoadRect(in)));
+                break;
+            case NodeKind::Unary: {
+                const auto type = static_cast<UnaryOpExpr::Type>(in.Read<char>());
+                if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                    throw malformed();
+                }
+                const Expr* operand = pop();
+                stack.push_back(arena.Make<UnaryOpExpr>(type, operand));
+                break;
+            }
+            case NodeKind::Binary: {
+                const auto type = static_cast<BinaryOpExpr::Type>(in.Read<char>());
+                if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                    && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                    throw malformed();
+                }
+                const Expr* rhs = pop();
+                const Expr* lhs = pop();
+                stack.push_back(arena.Make<BinaryOpExpr>(type, lhs, rhs));
+                break;
+            }
+            case NodeKind::Function: {
+                const auto function = in.Read<Function>();
+                const auto arg_count = in.Read<std::uint32_t>();
+                if (function > Function::Count || arg_count > stack.size()) {
+                    throw malformed();
+                }
+                const auto args =
+                    arena.CopyArray(stack.data() + stack.size() - arg_count, arg_count);
+                stack.resize(stack.size() - arg_count);
+                stack.push_back(arena.Make<FunctionExpr>(function, args));
+                break;
+            }
+            default:
+                throw malformed();
+        }
+    }
+    if (stack.size() != 1) {
+        throw malformed();
+    }
+    return stack.front();
+}
+
+// Checks that every operand of a loaded program is in bounds and the stack
+// never underflows. Returns the stack depth the program needs.
+size_t CheckProgram(const Program& program, size_t cell_count) {
+    const auto malformed = [] {
+        return SnapshotError("malformed formula program");
+    };
+    size_t depth = 0;
+    size_t max_depth = 0;
+    for (const Instruction& instr : program.code) {
+        switch (instr.op) {
+            case OpCode::Number:
+            case OpCode::Cell:
+                if (instr.operand >= (instr.op == OpCode::Number ? program.constants.size()
+                                                                 : cell_count)) {
+                    throw malformed();
+                }
+                ++depth;
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                if (depth < 2) {
+                    throw malformed();
+                }
+                --depth;
+                break;
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus:
+                if (depth < 1) {
+                    throw malformed();
+                }
+                break;
+            case OpCode::Call: {
+                if (instr.operand >= program.calls.size()) {
+                    throw malformed();
+                }
+                const Call& call = program.calls[instr.operand];
+                if (call.function > Function::Count || call.arg_count > depth
+                    || std::uint64_t{call.first_range} + call.range_count
+                           > program.call_ranges.size()) {
+                    throw malformed();
+                }
+                depth = depth - call.arg_count + 1;
+                break;
+            }
+            default:
+                throw malformed();
+        }
+        max_depth = std::max(max_depth, depth);
+    }
+    if (depth != 1) {
+        throw malformed();
+    }
+    return max_depth;
+}
+
+template <typename T, typename F>
+std::vector<T> LoadArray(SnapshotReader& in, size_t record_size, F load) {
+    std::vector<T> items(in.ReadCount(record_size));
+    for (T& item : items) {
+        item = load(in);
+    }
+    return items;
+}
 
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+bool IsFormulaParserAvailable(FormulaParserKind kind) {
+#ifdef SPREADSHEET_WITH_ANTLR
+    return true;
+#else
+    return kind != FormulaParserKind::Antlr;
+#endif
+}
+
+void SetFormulaParser(FormulaParserKind kind) {
+    if (!IsFormulaParserAvailable(kind)) {
+        throw std::invalid_argument("The formula parser is not built in");
+    }
+    ASTImpl::formula_parser = kind;
+}
+
+FormulaParserKind GetFormulaParser() {
+    return ASTImpl::formula_parser;
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+static FormulaAST ParseFormulaASTWithAntlr(std::string_view text) {
     using namespace antlr4;
 
-    ANTLRInputStream input(in);
+    ANTLRInputStream input{std::string(text)};
 
     FormulaLexer lexer(&input);
     ASTImpl::BailErrorListener error_listener;
@@ -386,14 +1520,70 @@ FormulaAST ParseFormulaAST(std::istream& in) {
 
     tree::ParseTree* tree = parser.main();
     ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    // the tree of a long sum is as deep as the number of its terms
+    tree::IterativeParseTreeWalker walker;
+    walker.walk(&listener, tree);
+
+    const ASTImpl::Expr* root = listener.MoveRoot();
+    return FormulaAST(listener.MoveArena(), root, listener.MoveCells(), listener.MoveRanges());
+}
+#endif
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::string_view text, FormulaParserKind kind) {
+#ifdef SPREADSHEET_WITH_ANTLR
+    if (kind == FormulaParserKind::Antlr) {
+        return ParseFormulaASTWithAntlr(text);
+    }
+#endif
+    if (!IsFormulaParserAvailable(kind)) {
+        throw std::invalid_argument("The formula parser is not built in");
+    }
+    return ASTImpl::HandWrittenParser(text).Parse();
+}
+
+std::optional<std::string> GetFormulaShape(std::string_view text, Position anchor) {
+    using ASTImpl::Tokenizer;
+
+    std::string shape;
+    shape.reserve(text.size() + 16);
+    const auto append_offset = [&shape](char axis, int offset) {
+        char buffer[16];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), offset);
+        assert(ec == std::errc());
+        shape += axis;
+        shape.append(buffer, end);
+    };
+
+    try {
+        Tokenizer tokenizer(text);
+        for (auto token = tokenizer.Next(); token.type != Tokenizer::TokenType::End;
+             token = tokenizer.Next()) {
+            if (token.type == Tokenizer::TokenType::Cell) {
+                const auto cell = Position::FromString(token.text);
+                if (!cell.IsValid()) {
+                    return std::nullopt;
+                }
+                append_offset('R', cell.row - anchor.row);
+                append_offset('C', cell.col - anchor.col);
+            } else {
+                shape += token.text;
+            }
+            // keeps 1 2 and 12 apart
+            shape += ' ';
+        }
+    } catch (const ParsingError&) {
+        return std::nullopt;
+    }
+    return shape;
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(text);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaAST(in_str, GetFormulaParser());
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -403,21 +1593,196 @@ void FormulaAST::PrintCells(std::ostream& out) const {
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::WalkTree(root_expr_, [&out](const ASTImpl::Expr* node, size_t step) {
+        return node->PrintStep(out, step);
+    });
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+    using ASTImpl::Expr;
+    ASTImpl::WalkTree(
+        root_expr_,
+        [&out, shift](const Expr* node, size_t step) {
+            return node->PrintFormulaStep(out, step, shift);
+        },
+        [&out](const Expr* node, const Expr* parent, size_t index) {
+            if (node->NeedsParens(parent, index)) {
+                out << '(';
+            }
+        },
+        [&out](const Expr* node, const Expr* parent, size_t index) {
+            if (node->NeedsParens(parent, index)) {
+                out << ')';
+            }
+        });
 }
 
-double FormulaAST::Execute(const SheetArgs& args) const {
-    return root_expr_->Evaluate(args);
+double FormulaAST::Execute(const SheetArgs& args, Position shift) const {
+    using ASTImpl::OpCode;
+
+    // each cell the program reads is resolved once, the program then reads slots
+    ASTImpl::LocalBuffer slots(cells_.size());
+    for (std::uint32_t i : program_.read_cells) {
+        slots[i] = args(ShiftPosition(cells_[i], shift));
+    }
+
+    ASTImpl::LocalBuffer stack(program_.max_stack_depth);
+    double* top = stack.data();
+    for (const ASTImpl::Instruction& instr : program_.code) {
+        switch (instr.op) {
+            case OpCode::Number:
+                *top++ = program_.constants[instr.operand];
+                break;
+            case OpCode::Cell:
+                *top++ = slots[instr.operand];
+                break;
+            case OpCode::Add:
+                --top;
+                top[-1] = ASTImpl::CheckFinite(top[-1] + top[0]);
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] = ASTImpl::CheckFinite(top[-1] - top[0]);
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] = ASTImpl::CheckFinite(top[-1] * top[0]);
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] = ASTImpl::CheckFinite(top[-1] / top[0]);
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::Call: {
+                const ASTImpl::Call& call = program_.calls[instr.operand];
+                top -= call.arg_count;
+                *top = ASTImpl::CallFunction(call, top, program_.call_ranges, args, shift);
+                ++top;
+                break;
+            }
+        }
+    }
+    return top[-1];
+}
+
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position> cells,
+                       std::vector<Rect> ranges)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr) {
+    // to avoid sorting in GetReferencedCells and to give every cell a single slot
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    cells_ = arena_.CopyArray(cells.data(), cells.size());
+
+    std::sort(ranges.begin(), ranges.end());
+    ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+    ranges_ = arena_.CopyArray(ranges.data(), ranges.size());
+
+    ASTImpl::ProgramBuilder builder(cells_);
+    ASTImpl::WalkTree(root_expr_, [&builder](const ASTImpl::Expr* node, size_t step) {
+        return node->CompileStep(builder, step);
+    });
+    program_ = builder.Build(arena_);
+}
+
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, ArenaSpan<Position> cells,
+                       ArenaSpan<Rect> ranges, ASTImpl::Program program)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , cells_(cells)
+    , ranges_(ranges)
+    , program_(program) {
+}
+
+void FormulaAST::Save(SnapshotWriter& out) const {
+    using namespace ASTImpl;
+
+    out.Write<std::uint64_t>(cells_.size());
+    for (Position cell : cells_) {
+        SavePosition(out, cell);
+    }
+    out.Write<std::uint64_t>(ranges_.size());
+    for (Rect range : ranges_) {
+        SaveRect(out, range);
+    }
+
+    out.Write<std::uint64_t>(program_.code.size());
+    for (const Instruction& instr : program_.code) {
+        out.Write(instr.op);
+        out.Write(instr.operand);
+    }
+    out.Write<std::uint64_t>(program_.constants.size());
+    for (double constant : program_.constants) {
+        out.Write(constant);
+    }
+    out.Write<std::uint64_t>(program_.calls.size());
+    for (const Call& call : program_.calls) {
+        out.Write(call.function);
+        out.Write(call.arg_count);
+        out.Write(call.first_range);
+        out.Write(call.range_count);
+    }
+    out.Write<std::uint64_t>(program_.call_ranges.size());
+    for (Rect range : program_.call_ranges) {
+        SaveRect(out, range);
+    }
+
+    SnapshotWriter tree;
+    WalkTree(root_expr_, [&tree](const Expr* node, size_t step) {
+        return node->SaveStep(tree, step);
+    });
+    out.WriteString(tree.GetData());
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST FormulaAST::Load(SnapshotReader& in) {
+    using namespace ASTImpl;
+
+    const auto cells = LoadArray<Position>(in, 8, LoadPosition);
+    const auto ranges = LoadArray<Rect>(in, 16, LoadRect);
+    const auto code = LoadArray<Instruction>(in, 5, [](SnapshotReader& in) {
+        Instruction instr;
+        instr.op = in.Read<OpCode>();
+        instr.operand = in.Read<std::uint32_t>();
+        return instr;
+    });
+    const auto constants = LoadArray<double>(in, 8, [](SnapshotReader& in) {
+        return in.Read<double>();
+    });
+    const auto calls = LoadArray<Call>(in, 13, [](SnapshotReader& in) {
+        Call call;
+        call.function = in.Read<Function>();
+        call.arg_count = in.Read<std::uint32_t>();
+        call.first_range = in.Read<std::uint32_t>();
+        call.range_count = in.Read<std::uint32_t>();
+        return call;
+    });
+    const auto call_ranges = LoadArray<Rect>(in, 16, LoadRect);
+    const std::string_view tree = in.ReadString();
+
+    // nodes take a few times more space than their saved records
+    Arena arena(cells.size() * sizeof(Position) + ranges.size() * sizeof(Rect)
+                + code.size() * sizeof(Instruction) + constants.size() * sizeof(double)
+                + calls.size() * sizeof(Call) + call_ranges.size() * sizeof(Rect)
+                + tree.size() * 8);
+    const auto cells_span = arena.CopyArray(cells.data(), cells.size());
+    const auto ranges_span = arena.CopyArray(ranges.data(), ranges.size());
+    Program program;
+    program.code = arena.CopyArray(code.data(), code.size());
+    program.constants = arena.CopyArray(constants.data(), constants.size());
+    program.calls = arena.CopyArray(calls.data(), calls.size());
+    program.call_ranges = arena.CopyArray(call_ranges.data(), call_ranges.size());
+    // the depth is recomputed rather than trusted: Execute() relies on it
+    program.max_stack_depth = CheckProgram(program, cells.size());
+    program.read_cells = CollectReadCells(program.code, cells.size(), arena);
+    const Expr* root = LoadTree(tree, arena);
+
+    return FormulaAST(std::move(arena), root, cells_span, ranges_span, program);
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
 FormulaAST::~FormulaAST() = default;
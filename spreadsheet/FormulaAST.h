@@ -1,51 +1,152 @@
 #pragma once
 
-#include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
+#include "formula.h"
 
-#include <forward_list>
-#include <functional>
+#include <cstdint>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
 
 namespace ASTImpl {
 class Expr;
-}
+
+enum class OpCode : std::uint8_t {
+    Number,      // push constants[operand]
+    Cell,        // push value of cells[operand]
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    UnaryPlus,   // no-op, kept so that the program mirrors the tree
+    UnaryMinus,
+    Call,        // replace the call arguments on the stack with calls[operand]
+};
+
+struct Instruction {
+    OpCode op;
+    std::uint32_t operand = 0;
+};
+
+enum class Function : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// An aggregate function call: arg_count values from the top of the stack
+// and range_count ranges from Program::call_ranges starting at first_range.
+struct Call {
+    Function function;
+    std::uint32_t arg_count = 0;
+    std::uint32_t first_range = 0;
+    std::uint32_t range_count = 0;
+};
+
+// Postfix program produced from the expression tree.
+// Operands are pushed onto a stack, operators pop their arguments
+// and push the result.
+struct Program {
+    ArenaSpan<Instruction> code;
+    // sorted indices of the cells that Cell instructions read; a cell that is
+    // only a plain function argument is read as a one-cell range instead
+    ArenaSpan<std::uint32_t> read_cells;
+    ArenaSpan<double> constants;
+    ArenaSpan<Call> calls;
+    ArenaSpan<Rect> call_ranges;
+    size_t max_stack_depth = 0;
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
-using SheetArgs = std::function<double(Position)>;
+// pos moved by shift.row rows and shift.col columns
+inline Position ShiftPosition(Position pos, Position shift) {
+    return {pos.row + shift.row, pos.col + shift.col};
+}
+
+inline Rect ShiftRect(Rect rect, Position shift) {
+    return {ShiftPosition(rect.top_left, shift), ShiftPosition(rect.bottom_right, shift)};
+}
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // root_expr and all nodes below it are allocated in arena;
+    // the cells, the ranges and the program are placed there too
+    FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, std::vector<Position> cells,
+               std::vector<Rect> ranges);
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
-    double Execute(const SheetArgs& args) const;
+    // A formula copied to another cell is the same tree with every reference
+    // moved by the same offset. Execute() and PrintFormula() work as if all
+    // references were moved by shift, so one tree serves all such copies.
+    double Execute(const SheetArgs& args, Position shift = {0, 0}) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position shift = {0, 0}) const;
+
+    // Writes the tree, the referenced cells and ranges and the compiled program
+    // so that Load() can restore the formula without parsing and compiling it.
+    void Save(SnapshotWriter& out) const;
+    // throws SnapshotError if the data is malformed
+    static FormulaAST Load(SnapshotReader& in);
 
-    std::forward_list<Position>& GetCells() {
+    // sorted referenced cells without duplicates;
+    // Cell instructions of the program index into this list
+    ArenaSpan<Position> GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // sorted ranges of function arguments without duplicates
+    ArenaSpan<Rect> GetRanges() const {
+        return ranges_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, ArenaSpan<Position> cells,
+               ArenaSpan<Rect> ranges, ASTImpl::Program program);
+
+    // owns everything below, so that a formula is one allocation in most cases
+    Arena arena_;
+    // the tree is only used to print the formula back,
+    // evaluation runs over program_
+    const ASTImpl::Expr* root_expr_;
+    ArenaSpan<Position> cells_;
+    ArenaSpan<Rect> ranges_;
+    ASTImpl::Program program_;
+};
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+enum class FormulaParserKind {
+    // generated from Formula.g4, available when built with SPREADSHEET_WITH_ANTLR
+    Antlr,
+    // operator precedence parser over the source text with an explicit stack,
+    // accepts the same grammar
+    HandWritten,
 };
 
+bool IsFormulaParserAvailable(FormulaParserKind kind);
+// selects the parser used by the ParseFormulaAST overloads without an explicit kind;
+// throws std::invalid_argument if the parser is not built in
+void SetFormulaParser(FormulaParserKind kind);
+FormulaParserKind GetFormulaParser();
+
+// Key that is equal for formulas which differ only in the cell they are written in:
+// the tokens of text with cell references replaced by their offsets from anchor.
+// Returns nullopt if text has no valid tokenization or refers outside the sheet,
+// such text never parses.
+std::optional<std::string> GetFormulaShape(std::string_view text, Position anchor);
+
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view text, FormulaParserKind kind);
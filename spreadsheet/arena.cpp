@@ -0,0 +1,70 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+Arena::Arena(size_t first_block_size)
+    : next_block_size_(std::clamp(first_block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE)) {}
+
+Arena::~Arena() {
+    Release();
+}
+
+Arena::Arena(Arena&& other) noexcept
+    : head_(std::exchange(other.head_, nullptr)),
+      current_(std::exchange(other.current_, nullptr)),
+      end_(std::exchange(other.end_, nullptr)),
+      next_block_size_(other.next_block_size_) {}
+
+Arena& Arena::operator=(Arena&& other) noexcept {
+    if (this != &other) {
+        Release();
+        head_ = std::exchange(other.head_, nullptr);
+        current_ = std::exchange(other.current_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+        next_block_size_ = other.next_block_size_;
+    }
+    return *this;
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    auto address = reinterpret_cast<std::uintptr_t>(current_);
+    size_t padding = (alignment - address % alignment) % alignment;
+    if (current_ == nullptr || static_cast<size_t>(end_ - current_) < padding + size) {
+        AddBlock(size + alignment);
+        address = reinterpret_cast<std::uintptr_t>(current_);
+        padding = (alignment - address % alignment) % alignment;
+    }
+    char* result = current_ + padding;
+    current_ = result + size;
+    return result;
+}
+
+size_t Arena::GetCapacity() const {
+    size_t capacity = 0;
+    for (const Block* block = head_; block != nullptr; block = block->prev) {
+        capacity += block->size;
+    }
+    return capacity;
+}
+
+void Arena::AddBlock(size_t min_size) {
+    const size_t size = std::max(next_block_size_, sizeof(Block) + min_size);
+    auto* block = static_cast<Block*>(::operator new(size));
+    block->prev = head_;
+    block->size = size;
+    head_ = block;
+    current_ = reinterpret_cast<char*>(block + 1);
+    end_ = reinterpret_cast<char*>(block) + size;
+    // следующие блоки растут вдвое, чтобы мелких было O(log n)
+    next_block_size_ = std::min(size * 2, MAX_BLOCK_SIZE);
+}
+
+void Arena::Release() {
+    while (head_ != nullptr) {
+        Block* prev = head_->prev;
+        ::operator delete(head_);
+        head_ = prev;
+    }
+    current_ = end_ = nullptr;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Непрерывный участок памяти из арены: массив из size элементов
+template <typename T>
+class ArenaSpan {
+public:
+    ArenaSpan() = default;
+    ArenaSpan(const T* data, size_t size)
+        : data_(data),
+          size_(size) {}
+
+    const T* begin() const {
+        return data_;
+    }
+
+    const T* end() const {
+        return data_ + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Линейный (bump) распределитель: память выдаётся подряд из блоков и
+// освобождается только вся сразу вместе с ареной. Объекты в арене не
+// уничтожаются, поэтому в ней можно размещать лишь тривиально
+// разрушаемые типы. Если первый блок задан достаточного размера, все
+// объекты лежат в одном выделении памяти. Блоки растут вдвое, но не больше
+// MAX_BLOCK_SIZE, поэтому у большой арены недоиспользовано не больше блока.
+class Arena {
+public:
+    explicit Arena(size_t first_block_size = MIN_BLOCK_SIZE);
+    ~Arena();
+
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t alignment);
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "objects in an arena are never destroyed");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Копирует массив в арену
+    template <typename T>
+    ArenaSpan<T> CopyArray(const T* data, size_t size) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (size == 0) {
+            return {};
+        }
+        void* memory = Allocate(sizeof(T) * size, alignof(T));
+        std::memcpy(memory, data, sizeof(T) * size);
+        return {static_cast<const T*>(memory), size};
+    }
+
+    // суммарный размер выделенных блоков
+    size_t GetCapacity() const;
+
+private:
+    static constexpr size_t MIN_BLOCK_SIZE = 256;
+    // первый и следующие блоки не крупнее этого; больший объект получает
+    // отдельный блок своего размера
+    static constexpr size_t MAX_BLOCK_SIZE = 1 << 20;
+
+    // заголовок в начале каждого блока, блоки связаны от нового к старому
+    struct Block {
+        Block* prev;
+        size_t size;
+    };
+
+    Block* head_ = nullptr;
+    char* current_ = nullptr;
+    char* end_ = nullptr;
+    size_t next_block_size_;
+
+    void AddBlock(size_t min_size);
+    void Release();
+};
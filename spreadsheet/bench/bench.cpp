@@ -0,0 +1,122 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+using namespace std::literals;
+
+namespace {
+size_t ParseCount(std::string_view key, const char* value) {
+    size_t parsed = 0;
+    const std::string text = value;
+    try {
+        parsed = std::stoull(text);
+    } catch (const std::logic_error&) {
+        throw std::invalid_argument("bad value of "s + std::string(key) + ": "s + text);
+    }
+    if (parsed == 0) {
+        throw std::invalid_argument(std::string(key) + " must be positive"s);
+    }
+    return parsed;
+}
+
+void WriteJsonString(std::ostream& output, std::string_view text) {
+    output << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            output << '\\';
+        }
+        output << c;
+    }
+    output << '"';
+}
+
+double Median(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    const size_t middle = samples.size() / 2;
+    return samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+}
+
+double Mean(const std::vector<double>& samples) {
+    return std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+}
+}  // namespace
+
+BenchOptions BenchOptions::Parse(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view key = argv[i];
+        if (i + 1 == argc) {
+            throw std::invalid_argument("missing value of "s + std::string(key));
+        }
+        const char* value = argv[++i];
+        if (key == "--out"sv) {
+            options.out = value;
+        } else if (key == "--filter"sv) {
+            options.filter = value;
+        } else if (key == "--repetitions"sv) {
+            options.repetitions = static_cast<int>(std::min<size_t>(ParseCount(key, value), 1000));
+        } else if (key == "--max-cells"sv) {
+            options.max_cells = ParseCount(key, value);
+        } else {
+            throw std::invalid_argument("unknown option "s + std::string(key));
+        }
+    }
+    return options;
+}
+
+BenchRunner::BenchRunner(BenchOptions options)
+    : options_(std::move(options)) {}
+
+const BenchOptions& BenchRunner::GetOptions() const {
+    return options_;
+}
+
+bool BenchRunner::IsSelected(const std::string& name) const {
+    return name.find(options_.filter) != std::string::npos;
+}
+
+void BenchRunner::Report(BenchResult result) {
+    std::cerr << std::left << std::setw(36) << result.name << std::right << std::setw(10)
+              << result.size << std::fixed << std::setprecision(3) << std::setw(14)
+              << Median(result.samples) << " ms" << std::endl;
+    results_.push_back(std::move(result));
+}
+
+void BenchRunner::WriteJson(std::ostream& output) const {
+    output << std::setprecision(6) << std::fixed;
+    output << "{\n  \"context\": {\n";
+#ifdef __VERSION__
+    output << "    \"compiler\": ";
+    WriteJsonString(output, __VERSION__);
+    output << ",\n";
+#endif
+#ifdef NDEBUG
+    output << "    \"assertions\": false,\n";
+#else
+    output << "    \"assertions\": true,\n";
+#endif
+    output << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+    output << "    \"repetitions\": " << options_.repetitions << "\n  },\n";
+
+    output << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const BenchResult& result = results_[i];
+        output << (i == 0 ? "\n" : ",\n") << "    {\"name\": ";
+        WriteJsonString(output, result.name);
+        output << ", \"size\": " << result.size
+               << ", \"min_ms\": " << *std::min_element(result.samples.begin(), result.samples.end())
+               << ", \"median_ms\": " << Median(result.samples)
+               << ", \"mean_ms\": " << Mean(result.samples) << ", \"samples_ms\": [";
+        for (size_t j = 0; j < result.samples.size(); ++j) {
+            output << (j == 0 ? "" : ", ") << result.samples[j];
+        }
+        output << "]}";
+    }
+    output << "\n  ]\n}\n";
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Параметры запуска бенчмарков из командной строки:
+//   --out FILE          записать JSON в файл, а не в стандартный вывод
+//   --filter TEXT       запускать только бенчмарки, в имени которых есть TEXT
+//   --repetitions N     число повторов каждого замера
+//   --max-cells N       наибольший размер листа в ячейках (до 10M)
+struct BenchOptions {
+    std::string out;
+    std::string filter;
+    int repetitions = 5;
+    size_t max_cells = 1000000;
+
+    // Бросает std::invalid_argument на неизвестном или неполном ключе
+    static BenchOptions Parse(int argc, char** argv);
+};
+
+// Время повтора бенчмарка: в зачёт идёт только то, что выполнено внутри
+// Time(), подготовка листа вокруг не учитывается
+class Stopwatch {
+public:
+    template <typename F>
+    void Time(F f) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        elapsed_ += std::chrono::steady_clock::now() - start;
+    }
+
+    double GetMilliseconds() const {
+        return std::chrono::duration<double, std::milli>(elapsed_).count();
+    }
+
+private:
+    std::chrono::steady_clock::duration elapsed_{};
+};
+
+struct BenchResult {
+    std::string name;
+    // размер задачи: ячеек на листе, формул, глубина цепочки
+    size_t size = 0;
+    // время повторов в миллисекундах
+    std::vector<double> samples;
+};
+
+// Запускает бенчмарки и собирает их результаты
+class BenchRunner {
+public:
+    explicit BenchRunner(BenchOptions options);
+
+    const BenchOptions& GetOptions() const;
+    // Проходит ли имя бенчмарка фильтр --filter
+    bool IsSelected(const std::string& name) const;
+
+    // Вызывает body(Stopwatch&) options.repetitions раз, если имя проходит
+    // фильтр. Каждый повтор начинается с нуля: всё, что body готовит вне
+    // Stopwatch::Time(), не измеряется.
+    template <typename F>
+    void Run(const std::string& name, size_t size, F body) {
+        if (!IsSelected(name)) {
+            return;
+        }
+        BenchResult result{name, size, {}};
+        for (int i = 0; i < options_.repetitions; ++i) {
+            Stopwatch watch;
+            body(watch);
+            result.samples.push_back(watch.GetMilliseconds());
+        }
+        Report(std::move(result));
+    }
+
+    // Результаты в JSON: для каждого замера имя, размер, минимум, медиана,
+    // среднее и все повторы
+    void WriteJson(std::ostream& output) const;
+
+private:
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+
+    // запоминает результат и печатает сводку в std::cerr
+    void Report(BenchResult result);
+};
@@ -0,0 +1,393 @@
+#include "bench.h"
+#include "flat_hash.h"
+#include "formula.h"
+#include "sheet.h"
+#include "workloads.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <unordered_set>
+
+using namespace std::literals;
+
+namespace {
+constexpr std::uint32_t SEED = 20240601;
+constexpr size_t SHEET_SIZES[] = {1000, 100000, 1000000, 10000000};
+constexpr size_t GRAPH_SIZES[] = {10000, 100000};
+
+// Буфер, отбрасывающий всё выведенное: печать измеряется без затрат на
+// память или файл
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+};
+
+std::string Name(std::string_view group, size_t size) {
+    return std::string(group) + "/" + std::to_string(size);
+}
+
+// Вызывает f(size) для размеров, не превышающих --max-cells
+template <typename Sizes, typename F>
+void ForEachSize(const BenchOptions& options, const Sizes& sizes, F f) {
+    for (size_t size : sizes) {
+        if (size <= options.max_cells) {
+            f(size);
+        }
+    }
+}
+
+void EvaluateAll(const Sheet& sheet, size_t count, int width) {
+    for (size_t i = 0; i < count; ++i) {
+        sheet.GetCell(GridPosition(i, width))->GetValue();
+    }
+}
+
+void BenchSetCell(BenchRunner& runner) {
+    ForEachSize(runner.GetOptions(), SHEET_SIZES, [&runner](size_t size) {
+        const int width = GridWidth(size);
+        const auto run = [&runner, size, width](std::string_view group,
+                                                const std::vector<std::string>& texts) {
+            runner.Run(Name(group, size), size, [&](Stopwatch& watch) {
+                auto sheet = std::make_unique<Sheet>();
+                watch.Time([&] {
+                    FillGrid(*sheet, texts, width);
+                });
+            });
+        };
+        run("set_cell/text", MakeTexts(size, SEED));
+        run("set_cell/number", MakeNumbers(size, SEED));
+        run("set_cell/formula", MakeGridFormulas(size, width, SEED));
+    });
+}
+
+void BenchParse(BenchRunner& runner) {
+    constexpr size_t COUNT = 10000;
+    const std::vector<std::string> expressions = MakeExpressions(COUNT, SEED);
+    runner.Run(Name("parse_formula", COUNT), COUNT, [&](Stopwatch& watch) {
+        watch.Time([&] {
+            for (const std::string& expression : expressions) {
+                ParseFormula(expression);
+            }
+        });
+    });
+}
+
+void BenchGetValue(BenchRunner& runner) {
+    ForEachSize(runner.GetOptions(), SHEET_SIZES, [&runner](size_t size) {
+        const int width = GridWidth(size);
+        const std::vector<std::string> texts = MakeGridFormulas(size, width, SEED);
+        // построчный обход вычисляет входы ячейки раньше неё самой
+        runner.Run(Name("get_value/cold", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            FillGrid(sheet, texts, width);
+            watch.Time([&] {
+                EvaluateAll(sheet, size, width);
+            });
+        });
+        runner.Run(Name("get_value/warm", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            FillGrid(sheet, texts, width);
+            EvaluateAll(sheet, size, width);
+            watch.Time([&] {
+                EvaluateAll(sheet, size, width);
+            });
+        });
+        // чтения попеременно из двух листов: каждое идёт в счётчики своего листа
+        runner.Run(Name("get_value/warm_two_sheets", size), size, [&](Stopwatch& watch) {
+            Sheet sheets[2];
+            for (Sheet& sheet : sheets) {
+                FillGrid(sheet, texts, width);
+                EvaluateAll(sheet, size, width);
+            }
+            watch.Time([&] {
+                for (size_t i = 0; i < size; ++i) {
+                    sheets[i % 2].GetCell(GridPosition(i, width))->GetValue();
+                }
+            });
+        });
+    });
+}
+
+// SUM над плотным блоком чисел: стоимость свёртки диапазона на ячейку
+void BenchRanges(BenchRunner& runner) {
+    ForEachSize(runner.GetOptions(), SHEET_SIZES, [&runner](size_t size) {
+        const int width = GridWidth(size);
+        const Rect block{{0, 0}, GridPosition(size - 1, width)};
+        const std::vector<std::string> numbers = MakeNumbers(size, SEED);
+        runner.Run(Name("range/sum", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            FillGrid(sheet, numbers, width);
+            const Position total{0, width};
+            sheet.SetCell(total, "=SUM(" + block.ToString() + ")");
+            watch.Time([&] {
+                sheet.GetCell(total)->GetValue();
+            });
+        });
+        // итог под каждым столбцом: правка ячейки находит в индексе
+        // диапазонов только итог своего столбца
+        runner.Run(Name("range/column_totals_edit", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            FillGrid(sheet, numbers, width);
+            const int rows = GridPosition(size - 1, width).row + 1;
+            for (int col = 0; col < width; ++col) {
+                const Rect column{{0, col}, {rows - 1, col}};
+                sheet.SetCell({rows, col}, "=SUM(" + column.ToString() + ")");
+            }
+            watch.Time([&] {
+                for (size_t i = 0; i < size; ++i) {
+                    sheet.SetCell(GridPosition(i, width), numbers[size - 1 - i]);
+                }
+            });
+        });
+    });
+}
+
+void BenchGraphs(BenchRunner& runner) {
+    ForEachSize(runner.GetOptions(), GRAPH_SIZES, [&runner](size_t size) {
+        runner.Run(Name("chain/build", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            watch.Time([&] {
+                BuildChain(sheet, size);
+            });
+        });
+        // чтение конца цепочки без кешей вычисляет всю цепочку
+        runner.Run(Name("chain/get_value", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            const Position tail = BuildChain(sheet, size);
+            watch.Time([&] {
+                sheet.GetCell(tail)->GetValue();
+            });
+        });
+        runner.Run(Name("chain/edit_recalc", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildChain(sheet, size);
+            sheet.Recalculate();
+            watch.Time([&] {
+                sheet.SetCell({0, 0}, "2");
+                sheet.Recalculate();
+            });
+        });
+
+        const int width = 100;
+        const int layers = static_cast<int>(size / width);
+        runner.Run(Name("diamond/edit_recalc", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildDiamonds(sheet, layers, width);
+            sheet.Recalculate();
+            watch.Time([&] {
+                sheet.SetCell({0, 0}, "-1");
+                sheet.Recalculate();
+            });
+        });
+
+        // правка ячейки-концентратора сбрасывает кеши всех её зависимых
+        runner.Run(Name("hub/invalidate", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildHub(sheet, size);
+            sheet.Recalculate();
+            watch.Time([&] {
+                sheet.SetCell({0, 0}, "2");
+            });
+        });
+        runner.Run(Name("hub/recalc", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildHub(sheet, size);
+            sheet.Recalculate();
+            sheet.SetCell({0, 0}, "2");
+            watch.Time([&] {
+                sheet.Recalculate();
+            });
+        });
+        runner.Run(Name("hub/recalc_parallel", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildHub(sheet, size);
+            sheet.Recalculate();
+            sheet.SetCell({0, 0}, "2");
+            watch.Time([&] {
+                sheet.Recalculate(RecalcPolicy::Parallel);
+            });
+        });
+
+        // частые правки концентратора, после каждой читается одна формула
+        for (const auto& [mode, label] : {std::pair{InvalidationMode::Eager, "hub/edit_read_eager"},
+                                          std::pair{InvalidationMode::Lazy, "hub/edit_read_lazy"}}) {
+            runner.Run(Name(label, size), size, [&, mode = mode](Stopwatch& watch) {
+                Sheet sheet;
+                sheet.SetInvalidationMode(mode);
+                BuildHub(sheet, size);
+                sheet.Recalculate();
+                watch.Time([&] {
+                    for (int i = 0; i < 100; ++i) {
+                        sheet.SetCell({0, 0}, std::to_string(i));
+                        sheet.GetCell({0, 1})->GetValue();
+                    }
+                });
+            });
+        }
+
+        // правка входа, не меняющая значения начала цепочки: при ленивом
+        // сбросе пересчёт останавливается на начале цепочки
+        for (const auto& [mode, label] : {std::pair{InvalidationMode::Eager, "cutoff/edit_recalc_eager"},
+                                          std::pair{InvalidationMode::Lazy, "cutoff/edit_recalc_lazy"}}) {
+            runner.Run(Name(label, size), size, [&, mode = mode](Stopwatch& watch) {
+                Sheet sheet;
+                sheet.SetInvalidationMode(mode);
+                BuildChain(sheet, size);
+                const Position input{0, Position::MAX_COLS - 1};
+                sheet.SetCell({0, 0}, "=" + input.ToString() + "*0+1");
+                sheet.Recalculate();
+                watch.Time([&] {
+                    for (int i = 0; i < 100; ++i) {
+                        sheet.SetCell(input, std::to_string(i));
+                        sheet.Recalculate();
+                    }
+                });
+            });
+        }
+
+        // начало цепочки ссылается на её конец: проверка проходит всю цепочку
+        runner.Run(Name("cycle_check/rejected", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            const std::string tail = "=" + BuildChain(sheet, size).ToString();
+            watch.Time([&] {
+                try {
+                    sheet.SetCell({0, 0}, tail);
+                } catch (const CircularDependencyException&) {
+                }
+            });
+        });
+        // начало цепочки ссылается на новую ячейку: цикла нет, но порядок
+        // ячеек приходится перестраивать
+        runner.Run(Name("cycle_check/accepted", size), size, [&](Stopwatch& watch) {
+            Sheet sheet;
+            BuildChain(sheet, size);
+            const std::string fresh = "=" + Position{0, Position::MAX_COLS - 1}.ToString();
+            watch.Time([&] {
+                sheet.SetCell({0, 0}, fresh);
+            });
+        });
+    });
+}
+
+void BenchPrint(BenchRunner& runner) {
+    ForEachSize(runner.GetOptions(), SHEET_SIZES, [&runner](size_t size) {
+        if (!runner.IsSelected(Name("print_values", size))
+            && !runner.IsSelected(Name("print_values_without_recalc", size))
+            && !runner.IsSelected(Name("print_texts", size))) {
+            return;
+        }
+        const int width = GridWidth(size);
+        const std::vector<std::string> texts = MakeGridFormulas(size, width, SEED);
+        Sheet sheet;
+        FillGrid(sheet, texts, width);
+        sheet.Recalculate();
+
+        NullBuffer buffer;
+        std::ostream output(&buffer);
+        runner.Run(Name("print_values", size), size, [&](Stopwatch& watch) {
+            watch.Time([&] {
+                sheet.PrintValues(output);
+            });
+        });
+        // повторная печать листа, на котором не вызывали Recalculate()
+        runner.Run(Name("print_values_without_recalc", size), size, [&](Stopwatch& watch) {
+            Sheet unrecalculated;
+            FillGrid(unrecalculated, texts, width);
+            unrecalculated.PrintValues(output);
+            watch.Time([&] {
+                unrecalculated.PrintValues(output);
+            });
+        });
+        runner.Run(Name("print_texts", size), size, [&](Stopwatch& watch) {
+            watch.Time([&] {
+                sheet.PrintTexts(output);
+            });
+        });
+    });
+}
+
+// Множество рёбер графа: вставка, поиск и удаление указателей на ячейки
+template <typename Set, typename Insert, typename Contains, typename Erase>
+void BenchPointerSet(BenchRunner& runner, std::string_view group, Insert insert, Contains contains,
+                     Erase erase) {
+    ForEachSize(runner.GetOptions(), GRAPH_SIZES, [&](size_t size) {
+        std::vector<std::unique_ptr<int>> nodes;
+        for (size_t i = 0; i < size; ++i) {
+            nodes.push_back(std::make_unique<int>(static_cast<int>(i)));
+        }
+        runner.Run(Name(group, size), size, [&](Stopwatch& watch) {
+            watch.Time([&] {
+                Set set;
+                for (const auto& node : nodes) {
+                    insert(set, node.get());
+                }
+                size_t found = 0;
+                for (const auto& node : nodes) {
+                    found += contains(set, node.get());
+                }
+                for (const auto& node : nodes) {
+                    erase(set, node.get());
+                }
+                if (found != nodes.size()) {
+                    throw std::logic_error("pointer set lost an element");
+                }
+            });
+        });
+    });
+}
+
+void BenchContainers(BenchRunner& runner) {
+    BenchPointerSet<FlatHashSet<const int*>>(
+        runner, "pointer_set/flat",
+        [](auto& set, const int* node) { set.Insert(node); },
+        [](const auto& set, const int* node) { return set.Contains(node); },
+        [](auto& set, const int* node) { set.Erase(node); });
+    BenchPointerSet<std::unordered_set<const int*>>(
+        runner, "pointer_set/unordered",
+        [](auto& set, const int* node) { set.insert(node); },
+        [](const auto& set, const int* node) { return set.count(node) != 0; },
+        [](auto& set, const int* node) { set.erase(node); });
+}
+}  // namespace
+
+// Бенчмарки листа. Сводка печатается в std::cerr по мере замеров, итог в
+// JSON - в файл --out или в стандартный вывод.
+int main(int argc, char** argv) {
+    BenchOptions options;
+    try {
+        options = BenchOptions::Parse(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\nusage: " << argv[0]
+                  << " [--out FILE] [--filter TEXT] [--repetitions N] [--max-cells N]" << std::endl;
+        return 2;
+    }
+
+    BenchRunner runner(options);
+    BenchContainers(runner);
+    BenchParse(runner);
+    BenchSetCell(runner);
+    BenchGetValue(runner);
+    BenchRanges(runner);
+    BenchGraphs(runner);
+    BenchPrint(runner);
+
+    if (options.out.empty()) {
+        runner.WriteJson(std::cout);
+        return 0;
+    }
+    std::ofstream output(options.out);
+    runner.WriteJson(output);
+    if (!output) {
+        std::cerr << "cannot write " << options.out << std::endl;
+        return 1;
+    }
+    return 0;
+}
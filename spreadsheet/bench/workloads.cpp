@@ -0,0 +1,163 @@
+#include "workloads.h"
+
+#include <algorithm>
+#include <array>
+#include <random>
+
+namespace {
+constexpr std::array<const char*, 12> WORDS = {
+    "total", "north", "south", "east", "west", "pending",
+    "paid", "refund", "Q1", "Q2", "Q3", "Q4",
+};
+
+std::string Name(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// Случайное выражение глубины не больше depth над ячейками первых 100
+// строк и столбцов
+std::string MakeExpression(std::mt19937& random, int depth) {
+    const auto pick = [&random](unsigned count) {
+        return static_cast<int>(random() % count);
+    };
+    if (depth == 0 || pick(4) == 0) {
+        switch (pick(3)) {
+            case 0:
+                return std::to_string(pick(1000)) + "." + std::to_string(pick(100));
+            case 1:
+                return Name(pick(100), pick(100));
+            default: {
+                const int row = pick(100);
+                const int col = pick(100);
+                static constexpr std::array<const char*, 5> FUNCTIONS = {
+                    "SUM", "AVERAGE", "MIN", "MAX", "COUNT",
+                };
+                return std::string(FUNCTIONS[pick(FUNCTIONS.size())]) + "(" + Name(row, col) + ":"
+                       + Name(row + pick(50), col + pick(10)) + ")";
+            }
+        }
+    }
+    static constexpr std::array<const char*, 4> OPERATORS = {"+", "-", "*", "/"};
+    std::string lhs = MakeExpression(random, depth - 1);
+    std::string rhs = MakeExpression(random, depth - 1);
+    if (pick(3) == 0) {
+        return "(" + lhs + OPERATORS[pick(OPERATORS.size())] + rhs + ")";
+    }
+    return lhs + OPERATORS[pick(OPERATORS.size())] + rhs;
+}
+}  // namespace
+
+Position GridPosition(size_t index, int width) {
+    return {static_cast<int>(index / width), static_cast<int>(index % width)};
+}
+
+int GridWidth(size_t count) {
+    // 10000 строк оставляют запас до предела листа по строкам
+    const size_t width = std::max<size_t>(100, (count + 9999) / 10000);
+    return static_cast<int>(std::min<size_t>(width, Position::MAX_COLS));
+}
+
+std::vector<std::string> MakeTexts(size_t count, std::uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<std::string> texts;
+    texts.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        texts.push_back(WORDS[random() % WORDS.size()]);
+    }
+    return texts;
+}
+
+std::vector<std::string> MakeNumbers(size_t count, std::uint32_t seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> distribution(-1e6, 1e6);
+    std::vector<std::string> texts;
+    texts.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        texts.push_back(std::to_string(distribution(random)));
+    }
+    return texts;
+}
+
+std::vector<std::string> MakeGridFormulas(size_t count, int width, std::uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<std::string> texts;
+    texts.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const Position pos = GridPosition(i, width);
+        if (pos.row == 0) {
+            texts.push_back(std::to_string(i % 100));
+            continue;
+        }
+        const std::string above = Name(pos.row - 1, pos.col);
+        if (pos.col == 0) {
+            texts.push_back("=" + above + "+1");
+            continue;
+        }
+        const std::string left = Name(pos.row, pos.col - 1);
+        switch (random() % 10) {
+            case 0:
+                texts.push_back("=SUM(" + Name(pos.row - 1, std::max(pos.col - 9, 0)) + ":" + above
+                                + ")/10");
+                break;
+            case 1:
+            case 2:
+                texts.push_back("=" + above + "-" + left + "+1");
+                break;
+            case 3:
+            case 4:
+                texts.push_back("=" + above + "*0.5+" + left + "*0.5");
+                break;
+            default:
+                texts.push_back("=(" + above + "+" + left + ")/2");
+        }
+    }
+    return texts;
+}
+
+std::vector<std::string> MakeExpressions(size_t count, std::uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<std::string> expressions;
+    expressions.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        expressions.push_back(MakeExpression(random, 1 + static_cast<int>(random() % 5)));
+    }
+    return expressions;
+}
+
+void FillGrid(Sheet& sheet, const std::vector<std::string>& texts, int width) {
+    for (size_t i = 0; i < texts.size(); ++i) {
+        sheet.SetCell(GridPosition(i, width), texts[i]);
+    }
+}
+
+Position BuildChain(Sheet& sheet, size_t length) {
+    const auto position = [](size_t index) {
+        return Position{static_cast<int>(index % Position::MAX_ROWS),
+                        static_cast<int>(index / Position::MAX_ROWS)};
+    };
+    sheet.SetCell(position(0), "1");
+    for (size_t i = 1; i < length; ++i) {
+        sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+    }
+    return position(length - 1);
+}
+
+void BuildDiamonds(Sheet& sheet, int layers, int width) {
+    for (int col = 0; col < width; ++col) {
+        sheet.SetCell({0, col}, std::to_string(col));
+    }
+    for (int row = 1; row < layers; ++row) {
+        for (int col = 0; col < width; ++col) {
+            sheet.SetCell({row, col}, "=" + Name(row - 1, col) + "+" + Name(row - 1, (col + 1) % width));
+        }
+    }
+}
+
+void BuildHub(Sheet& sheet, size_t dependents) {
+    sheet.SetCell({0, 0}, "1");
+    for (size_t i = 0; i < dependents; ++i) {
+        const Position pos{static_cast<int>(i % Position::MAX_ROWS),
+                           1 + static_cast<int>(i / Position::MAX_ROWS)};
+        sheet.SetCell(pos, "=A1+" + std::to_string(i));
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Генераторы синтетических листов для бенчмарков. Все они детерминированы:
+// одинаковые параметры дают одинаковый лист, поэтому замеры разных сборок
+// можно сравнивать между собой.
+
+// Позиция ячейки с номером index в листе, заполняемом построчно по width
+// столбцов
+Position GridPosition(size_t index, int width);
+
+// Ширина, при которой count ячеек умещаются в лист не выше его предела
+int GridWidth(size_t count);
+
+// Тексты count ячеек, заполняемых построчно: слова из небольшого словаря,
+// поэтому тексты повторяются, как в реальных таблицах
+std::vector<std::string> MakeTexts(size_t count, std::uint32_t seed);
+// Числа count ячеек, записанные текстом
+std::vector<std::string> MakeNumbers(size_t count, std::uint32_t seed);
+// Формулы count ячеек сетки шириной width. Первая строка - числа, дальше
+// каждая ячейка ссылается на соседей сверху и слева, а каждая десятая
+// суммирует отрезок строки над собой.
+std::vector<std::string> MakeGridFormulas(size_t count, int width, std::uint32_t seed);
+// Отдельные выражения разной формы и длины, без знака '=' впереди
+std::vector<std::string> MakeExpressions(size_t count, std::uint32_t seed);
+
+// Записывает тексты в ячейки сетки шириной width
+void FillGrid(Sheet& sheet, const std::vector<std::string>& texts, int width);
+
+// Цепочка A1 = 1, A2 = A1+1, ... длиной length. Длинная цепочка
+// переходит в следующие столбцы, возвращается позиция её последней ячейки.
+Position BuildChain(Sheet& sheet, size_t length);
+
+// Слои ромбов: слой 0 - числа, ячейка j слоя k ссылается на ячейки j и
+// j + 1 (по кругу) слоя k - 1. Слой занимает строку листа.
+void BuildDiamonds(Sheet& sheet, int layers, int width);
+
+// Ячейка A1 и dependents формул, ссылающихся на неё
+void BuildHub(Sheet& sheet, size_t dependents);
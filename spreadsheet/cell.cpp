@@ -2,116 +2,333 @@
 #include "sheet.h"
 
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <optional>
 
-class Cell::Impl{
-public:
-explicit Impl(const std::string raw) 
-: raw_text_(raw) {}
-virtual Value GetValue() = 0;
-    virtual std::string GetText() = 0;
-    virtual std::vector<Position> GetReferencedCells() { return {};}
-protected:
-    std::string raw_text_;
-};
-
-class Cell::EmptyImpl final : public Cell::Impl{
-public:
-    explicit EmptyImpl(const std::string raw)
-    : Cell::Impl(raw) {}
-
-    Value GetValue() override{ return "";}
-    std::string GetText() override{ return "";}
-};
-
-class Cell::TextImpl : public Cell::Impl{
-public:
-    explicit TextImpl(const std::string raw)
-    : Cell::Impl(raw) {}
-
-    Value GetValue() override{ return raw_text_[0] == ESCAPE_SIGN ? raw_text_.substr(1) : raw_text_;}
-    std::string GetText() override{ return raw_text_;}
-};
-
-class Cell::FormulaImpl : public Cell::Impl{
-public:
-    explicit FormulaImpl(const std::string& raw, Sheet& sheet)
-    : Cell::Impl(raw),
-    sheet_(sheet),
-    formula_(ParseFormula(raw.substr(1))) {}
-
-    Value GetValue() override{
-        FormulaInterface::Value result = formula_->Evaluate(sheet_);
-
-        if(std::holds_alternative<double>(result)){
-            return std::get<double>(result);
-        }else if(std::holds_alternative<FormulaError>(result)){
-            return std::get<FormulaError>(result);
-        }
-        return raw_text_;
-    }
-
-    std::string GetText() override{return FORMULA_SIGN + formula_->GetExpression();}
-    std::vector<Position> GetReferencedCells() override { return formula_->GetReferencedCells();}
-
-private:
-    Sheet& sheet_;
-    std::unique_ptr<FormulaInterface> formula_;
-};
-
-Cell::Cell(Sheet& sheet)
+namespace {
+// Числа сравниваются вместе со знаком, иначе 0 и -0 дали бы разные
+// результаты, например, при делении на них
+bool SameNumber(double lhs, double rhs) {
+    return lhs == rhs && std::signbit(lhs) == std::signbit(rhs);
+}
+
+bool SameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+    if (const double* number = std::get_if<double>(&lhs)) {
+        const double* other = std::get_if<double>(&rhs);
+        return other != nullptr && SameNumber(*number, *other);
+    }
+    return lhs == rhs;
+}
+}  // namespace
+
+Cell::Cell(Sheet& sheet, Position pos)
     : sheet_(sheet),
-      impl_(std::make_unique<EmptyImpl>("")) {}
+      pos_(pos),
+      order_(sheet.AllocateOrder(pos)) {}
 
 Cell::~Cell() = default;
 
 void Cell::Set(std::string text, Position pos) {
-    std::unique_ptr<Impl> impl;
+    Content content = MakeContent(std::move(text), pos);
 
-    bool NeedCyclicTest = false;
+    if(content.formula
+       && HasCircularDependency(content.formula->GetReferencedCells(),
+                                content.formula->GetReferencedRanges(), pos)){
+        throw CircularDependencyException("Circular dependency"); 
+    }
+
+    const Content previous = ReplaceContent(std::move(content), true);
+    RestoreTopologicalOrder();
+    if(!SameForDependents(previous)){
+        MarkChanged();
+        if(sheet_.GetInvalidationMode() == InvalidationMode::Eager){
+            InvalidateCacheChilds();
+        }
+    }else if(!StaysEmpty(previous)){
+        // кеши зависимых ячеек остаются верными
+        StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().cutoffs, 1);
+    }
+    is_empty = false;
+}
 
+Cell::Content Cell::MakeContent(std::string text, Position pos) {
+    Content content;
     if(text.empty()){
-        impl = std::make_unique<EmptyImpl>("");
-    }else if(text[0] == FORMULA_SIGN && text.size() > 1){
+        return content;
+    }
+    if(text[0] == FORMULA_SIGN && text.size() > 1){
         try{
-            impl = std::make_unique<FormulaImpl>(text, sheet_);
-            NeedCyclicTest = true;
+            content.formula = sheet_.ParseCellFormula(std::string_view(text).substr(1), pos);
         }
         catch(...){
             throw FormulaException("Incorrect formula format");
         }
+        content.kind = Kind::Formula;
+        content.has_value = false;
+        return content;
+    }
+    content.kind = Kind::Text;
+    content.escaped = text[0] == ESCAPE_SIGN;
+    content.text = sheet_.GetTextPool().Intern(
+        std::string_view(text).substr(content.escaped ? 1 : 0));
+    return content;
+}
+
+bool Cell::SameForDependents(const Content& previous) const {
+    if(previous.kind != kind_ || kind_ == Kind::Formula){
+        return false;
+    }
+    if(kind_ == Kind::Empty){
+        return true;
+    }
+    // зависимые читают текст как число, см. GetNumber() и AccumulateValue()
+    const std::optional<double>& number = text_.GetNumber();
+    const std::optional<double>& previous_number = previous.text.GetNumber();
+    if(number && previous_number){
+        return SameNumber(*number, *previous_number);
+    }
+    return !number && !previous_number && text_.GetText() == previous.text.GetText();
+}
+
+bool Cell::StaysEmpty(const Content& previous) const {
+    return previous.kind == Kind::Empty && kind_ == Kind::Empty;
+}
+
+void Cell::MarkChanged() {
+    changed_at_ = sheet_.AdvanceRevision();
+    if(sheet_.GetInvalidationMode() == InvalidationMode::Lazy){
+        sheet_.MarkChanged(this);
+    }
+}
+
+Cell::Content Cell::ReplaceContent(Content content, bool create_inputs) {
+    if(links_){
+        StatsCollector::Counters& counters = sheet_.GetStatsCollector().Local();
+        StatsCollector::Counters::Add(counters.cell_edges,
+                                      -static_cast<std::int64_t>(links_->referenced_by.GetSize()));
+        StatsCollector::Counters::Add(counters.range_edges,
+                                      -static_cast<std::int64_t>(links_->referenced_ranges.size()));
+        for (Cell* cell: links_->referenced_by){
+            cell->links_->reference_to.Erase(this);
+            cell->ReleaseUnusedLinks();
+        }
+        links_->referenced_by.Clear();
+        for (RangeIndex::Handle handle : links_->range_handles){
+            sheet_.GetRangeIndex().Erase(handle);
+        }
+        links_->range_handles.clear();
+        links_->referenced_ranges.clear();
+    }
+
+    Content previous;
+    previous.kind = std::exchange(kind_, content.kind);
+    previous.escaped = std::exchange(escaped_, content.escaped);
+    previous.has_value = std::exchange(has_value_, content.has_value);
+    previous.text = std::exchange(text_, std::move(content.text));
+    if(links_){
+        previous.value = std::move(links_->value);
+        previous.formula = std::move(links_->formula);
+    }
+
+    if(content.formula){
+        Links& links = GetLinks();
+        links.value = std::move(content.value);
+        links.formula = std::move(content.formula);
+        links.referenced_ranges = links.formula->GetReferencedRanges();
+        for (Rect range : links.referenced_ranges){
+            links.range_handles.push_back(sheet_.GetRangeIndex().Insert(range, this));
+        }
+        StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().range_edges,
+                                      links.referenced_ranges.size());
+        LinkInputs(create_inputs);
     }else{
-        impl = std::make_unique<TextImpl>(text);
+        ReleaseUnusedLinks();
     }
+    return previous;
+}
 
-    if(NeedCyclicTest && TestCyclicDependance(impl->GetReferencedCells(), pos)){
-        throw CircularDependencyException("Circular dependency"); 
+void Cell::LinkInputs(bool create_inputs) {
+    if(kind_ != Kind::Formula){
+        return;
     }
+    std::int64_t linked = 0;
+    for(Position reference_pos : links_->formula->GetReferencedCells()){ 
+        Cell* reference_cell = create_inputs ? sheet_.GetOrCreateCell(reference_pos)
+                                             : sheet_.FindCell(reference_pos);
+        if(reference_cell == nullptr){
+            continue;
+        }
+        linked += links_->referenced_by.Insert(reference_cell);
+        reference_cell->GetLinks().reference_to.Insert(this);
+    }     
+    StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().cell_edges, linked);
+}
 
-    for (Cell* cell: referenced_by){
-        cell->GetReferenceTo().erase(this);
+Cell::Links& Cell::GetLinks() {
+    if(!links_){
+        links_ = std::make_unique<Links>();
     }
-    referenced_by.clear();
+    return *links_;
+}
 
-    impl_ = std::move(impl);
-    referenced_cells_ = impl_-> GetReferencedCells();
+void Cell::ReleaseUnusedLinks() {
+    if(links_ && !links_->formula && links_->referenced_by.Empty()
+       && links_->reference_to.Empty()){
+        links_.reset();
+    }
+}
 
-    if(IsReferenced()){ 
-        for(Position reference_pos : referenced_cells_ ){ 
-            Cell* reference_cell = sheet_.GetOrCreateCell(reference_pos); 
-            if(!referenced_by.count(reference_cell)){ 
-                referenced_by.insert(reference_cell); 
-            } 
-            if(!reference_cell->GetReferenceTo().count(this)){ 
-                reference_cell->GetReferenceTo().insert(this); 
-            } 
-        }     
+void Cell::ApplyBatch(std::vector<BatchEdit>& edits) {
+    if(edits.empty()){
+        return;
+    }
+    Sheet& sheet = edits.front().cell->sheet_;
+    const auto drop_created = [&edits](){
+        for(BatchEdit& edit : edits){
+            if(edit.created){
+                edit.cell->is_empty = true;
+            }
+        }
+    };
+
+    std::vector<Content> contents;
+    contents.reserve(edits.size());
+    try{
+        for(BatchEdit& edit : edits){
+            if(edit.formula){
+                Content& content = contents.emplace_back();
+                content.kind = Kind::Formula;
+                content.has_value = false;
+                content.formula = std::move(edit.formula);
+            }else if(edit.text){
+                contents.push_back(edit.cell->MakeContent(*edit.text, edit.cell->pos_));
+            }else{
+                contents.emplace_back();
+            }
+        }
+    }
+    catch(...){
+        drop_created();
+        throw;
+    }
+
+    // Связи ставятся только между существующими ячейками: ещё не заведённая
+    // ячейка ни от чего не зависит и в цикл входить не может
+    for(size_t i = 0; i < edits.size(); ++i){
+        contents[i] = edits[i].cell->ReplaceContent(std::move(contents[i]), false);
+    }
+
+    std::optional<std::vector<Cell*>> dependents = SortDependents(edits);
+    if(!dependents){
+        // прежнее содержимое возвращается вместе с вычисленными значениями
+        for(size_t i = edits.size(); i-- > 0;){
+            edits[i].cell->ReplaceContent(std::move(contents[i]), false);
+        }
+        drop_created();
+        throw CircularDependencyException("Circular dependency");
+    }
+
+    // В режиме Eager кеши зависимых всех правленых ячеек сбрасываются ниже
+    // одним проходом, поэтому отсечением правка считается только в Lazy
+    const bool eager = sheet.GetInvalidationMode() == InvalidationMode::Eager;
+    std::uint64_t cutoffs = 0;
+    for(size_t i = 0; i < edits.size(); ++i){
+        Cell* cell = edits[i].cell;
+        cell->LinkInputs(true);
+        cell->is_empty = !edits[i].text.has_value();
+        if(!cell->SameForDependents(contents[i])){
+            cell->MarkChanged();
+        }else if(!eager && !cell->StaysEmpty(contents[i])){
+            ++cutoffs;
+        }
+    }
+    StatsCollector::Counters::Add(sheet.GetStatsCollector().Local().cutoffs, cutoffs);
+    // Зависимые правленых ячеек переносятся в конец порядка, в котором их
+    // отсортировали: все их входы вне этого набора стоят раньше
+    std::uint64_t invalidated = 0;
+    for(Cell* cell : *dependents){
+        cell->order_ = sheet.AllocateLastOrder();
+        if(eager){
+            invalidated += cell->InvalidateCache();
+        }
+    }
+    if(eager){
+        sheet.GetStatsCollector().AddInvalidation(invalidated);
     }
-    
-    InvalidateCacheChilds();
-    is_empty = false;
+}
+
+std::optional<std::vector<Cell*>> Cell::SortDependents(const std::vector<BatchEdit>& edits) {
+    Sheet& sheet = edits.front().cell->sheet_;
+    const std::uint32_t mark = sheet.NewVisitMark();
+    std::vector<Cell*> cells;
+    for(const BatchEdit& edit : edits){
+        edit.cell->visit_mark_ = mark;
+        cells.push_back(edit.cell);
+    }
+    FlatHashMap<const Cell*, std::uint32_t> input_counts;
+    for(size_t i = 0; i < cells.size(); ++i){
+        cells[i]->ForEachDependent([&](Cell* dependent){
+            ++input_counts[dependent];
+            if(dependent->visit_mark_ != mark){
+                dependent->visit_mark_ = mark;
+                cells.push_back(dependent);
+            }
+        });
+    }
+    StatsCollector::Counters& counters = sheet.GetStatsCollector().Local();
+    StatsCollector::Counters::Add(counters.cycle_checks, 1);
+    StatsCollector::Counters::Add(counters.cycle_check_visits, cells.size());
+
+    // алгоритм Кана: ячейки, оставшиеся с необработанными входами, лежат на цикле
+    std::vector<Cell*> order;
+    order.reserve(cells.size());
+    for(Cell* cell : cells){
+        if(!input_counts.Contains(cell)){
+            order.push_back(cell);
+        }
+    }
+    for(size_t head = 0; head < order.size(); ++head){
+        order[head]->ForEachDependent([&](Cell* dependent){
+            if(--input_counts[dependent] == 0){
+                order.push_back(dependent);
+            }
+        });
+    }
+    if(order.size() != cells.size()){
+        return std::nullopt;
+    }
+    return order;
+}
+
+void Cell::Restore(std::unique_ptr<FormulaInterface> formula, std::string text, int order,
+                   std::optional<Value> cached_value, bool empty) {
+    if(formula){
+        kind_ = Kind::Formula;
+        GetLinks().formula = std::move(formula);
+        links_->referenced_ranges = links_->formula->GetReferencedRanges();
+        has_value_ = cached_value.has_value();
+        if(cached_value){
+            links_->value = std::move(*cached_value);
+        }
+    }else{
+        Content content = MakeContent(std::move(text), pos_);
+        kind_ = content.kind;
+        escaped_ = content.escaped;
+        text_ = std::move(content.text);
+    }
+    order_ = order;
+    is_empty = empty;
+}
+
+void Cell::LinkRestored() {
+    for (Rect range : GetReferencedRanges()){
+        links_->range_handles.push_back(sheet_.GetRangeIndex().Insert(range, this));
+    }
+    StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().range_edges,
+                                  GetReferencedRanges().size());
+    LinkInputs(false);
 }
 
 void Cell::Clear() {
@@ -120,80 +337,388 @@ void Cell::Clear() {
 }
 
 Cell::Value Cell::GetValue() const {
-    if(!cached_value_.has_value()){
-        cached_value_ = std::make_optional<Value>(impl_->GetValue());
+    StatsCollector::Counters& counters = sheet_.GetStatsCollector().Local();
+    StatsCollector::Counters::Add(HasCachedValue() ? counters.cache_hits : counters.cache_misses, 1);
+    return GetCachedValue();
+}
+
+const Cell::Value& Cell::GetCachedValue() const {
+    switch(kind_){
+        case Kind::Empty:
+            break;
+        case Kind::Text:
+            return text_.GetValue();
+        case Kind::Formula:
+            if(!HasCachedValue()){
+                Refresh();
+            }
+            return links_->value;
     }
-    return cached_value_.value();
+    static const Value empty_value = std::string();
+    return empty_value;
+}
+
+void Cell::Refresh() const {
+    // Обход в глубину с явным стеком: ячейка обновляется, когда обновлены
+    // все её входы, поэтому вычисление формулы читает только готовые кеши и
+    // не уходит по ссылкам вглубь стека вызовов. Глубина цепочки ссылок
+    // ограничена лишь памятью. Ячейка может попасть в стек несколько раз,
+    // повторно она снимается уже с верным кешем.
+    struct Frame {
+        const Cell* cell;
+        bool inputs_pushed;
+    };
+    std::vector<Frame> frames{{this, false}};
+    while(!frames.empty()){
+        const Cell* cell = frames.back().cell;
+        if(cell->HasCachedValue()){
+            frames.pop_back();
+            continue;
+        }
+        if(!frames.back().inputs_pushed){
+            frames.back().inputs_pushed = true;
+            cell->ForEachInput([&frames](const Cell* input){
+                if(input->kind_ == Kind::Formula && !input->HasCachedValue()){
+                    frames.push_back({input, false});
+                }
+            });
+            continue;
+        }
+        frames.pop_back();
+        cell->UpdateCache();
+    }
+}
+
+void Cell::UpdateCache() const {
+    if(has_value_ && ValidateCache()){
+        return;
+    }
+    Value value = Evaluate();
+    links_->verified_at = sheet_.GetRevision();
+    // Раннее отсечение: при прежнем значении версия ячейки не меняется, и
+    // зависимые подтвердят свои кеши без вычисления. При немедленном сбросе
+    // прежнего значения уже нет.
+    if(has_value_ && SameValue(value, links_->value)){
+        StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().cutoffs, 1);
+    }else{
+        links_->value = std::move(value);
+        changed_at_ = links_->verified_at;
+        has_value_ = true;
+    }
+}
+
+bool Cell::ValidateCache() const {
+    // входы уже обновлены, поэтому их версии учитывают все правки, от
+    // которых они зависят
+    bool changed = false;
+    ForEachInput([&](const Cell* input){
+        changed = changed || input->changed_at_ > links_->verified_at;
+    });
+    if(changed){
+        return false;
+    }
+    links_->verified_at = sheet_.GetRevision();
+    StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().cache_validations, 1);
+    return true;
+}
+
+Cell::Value Cell::Evaluate() const {
+    StatsCollector::Counters::Add(sheet_.GetStatsCollector().Local().evaluations, 1);
+    const Sheet& sheet = sheet_;
+    const auto resolve = [&sheet](Position pos) -> double {
+        if (!pos.IsValid()) { throw FormulaError(FormulaError::Category::Ref);}
+
+        const Cell* cell = sheet.FindCell(pos);
+        if (!cell) { return 0.0;}
+
+        return cell->GetNumber();
+    };
+    const auto read_range = [&sheet](Rect range, RangeAccumulator& accumulator) {
+        sheet.ForEachCellInRect(range, [&accumulator](Position, const Cell& cell) {
+            cell.AccumulateValue(accumulator);
+        });
+    };
+    FormulaInterface::Value result = links_->formula->Evaluate(SheetArgs(resolve, read_range));
+
+    if(std::holds_alternative<double>(result)){
+        return std::get<double>(result);
+    }
+    return std::get<FormulaError>(result);
+}
+
+bool Cell::HasCachedValue() const {
+    if(!has_value_ || kind_ != Kind::Formula
+       || sheet_.GetInvalidationMode() == InvalidationMode::Eager){
+        return has_value_;
+    }
+    // после распространения правок непроверенные кеши тоже верны
+    return links_->verified_at == sheet_.GetRevision()
+           || sheet_.GetPropagatedRevision() == sheet_.GetRevision();
+}
+
+std::uint64_t Cell::GetChangedAt() const {
+    return changed_at_;
+}
+
+double Cell::GetNumber() const {
+    if(kind_ == Kind::Empty){
+        return 0;
+    }
+    if(kind_ == Kind::Text){
+        if(const std::optional<double>& number = text_.GetNumber()){
+            return *number;
+        }
+        if(text_.GetText().empty()){
+            return 0;
+        }
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    return CellValueToNumber(GetCachedValue());
+}
+
+void Cell::AccumulateValue(RangeAccumulator& accumulator) const {
+    if(kind_ == Kind::Text){
+        if(const std::optional<double>& number = text_.GetNumber()){
+            accumulator.Add(*number);
+            return;
+        }
+    }
+    accumulator.Add(GetCachedValue());
+}
+
+int Cell::GetOrder() const {
+    return order_;
+}
+
+void Cell::SetOrder(int order) {
+    order_ = order;
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    switch(kind_){
+        case Kind::Empty:
+            return {};
+        case Kind::Text: {
+            const std::string& text = text_.GetText();
+            return escaped_ ? ESCAPE_SIGN + text : text;
+        }
+        case Kind::Formula:
+            return FORMULA_SIGN + links_->formula->GetExpression();
+    }
+    assert(false);
+    return {};
+}
+
+bool Cell::HasText() const {
+    return kind_ != Kind::Empty;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return kind_ == Kind::Formula ? links_->formula.get() : nullptr;
 }
 
 std::vector<Position> Cell::GetReferencedCells() const{
-    return referenced_cells_;
+    if(kind_ != Kind::Formula){
+        return {};
+    }
+    return links_->formula->GetReferencedCells();
 }
 
-bool Cell::IsReferenced() const{
-    return !referenced_cells_.empty();
+const std::vector<Rect>& Cell::GetReferencedRanges() const{
+    static const std::vector<Rect> no_ranges;
+    return links_ ? links_->referenced_ranges : no_ranges;
 }
 
-std::unordered_set<Cell*>& Cell::GetReferencedBy(){
-    return referenced_by;
+bool Cell::IsReferenced() const{
+    return !GetReferencedCells().empty();
 }
 
-std::unordered_set<Cell*>& Cell::GetReferenceTo(){
-    return reference_to;
+bool Cell::InvalidateCache(){
+    // значение текста и пустой ячейки не зависит от других ячеек
+    if(kind_ != Kind::Formula){
+        return false;
+    }
+    const bool had_value = std::exchange(has_value_, false);
+    sheet_.MarkDirty(this);
+    return had_value;
 }
 
-void Cell::InvalidateCache(){
-    cached_value_.reset();
+void Cell::AdoptInvalidationMode(InvalidationMode mode){
+    if(kind_ != Kind::Formula){
+        return;
+    }
+    if(mode == InvalidationMode::Lazy){
+        // при немедленном сбросе кеш верен, пока он есть
+        if(has_value_){
+            links_->verified_at = sheet_.GetRevision();
+        }
+    }else if(!HasCachedValue()){
+        // кеш, не проверенный в текущей версии, мог устареть
+        InvalidateCache();
+    }
 }
 
 void Cell::InvalidateCacheChilds(){
-    InvalidateCache();
+    std::uint64_t invalidated = InvalidateCache();
     std::stack<Cell*> to_invalidate;
-    for(Cell* ref_to : reference_to){
-        to_invalidate.push(ref_to);
-    }
+    const auto push = [&to_invalidate](Cell* dependent){
+        to_invalidate.push(dependent);
+    };
+    ForEachDependent(push);
     while (!to_invalidate.empty()){
         Cell* invalidate_cell = to_invalidate.top();
         to_invalidate.pop();
-        if(invalidate_cell->cached_value_.has_value()){
-            for(Cell* ref_to : invalidate_cell->reference_to){
-                to_invalidate.push(ref_to);
-            }
-            invalidate_cell->InvalidateCache();
+        if(invalidate_cell->has_value_){
+            invalidate_cell->ForEachDependent(push);
+            invalidated += invalidate_cell->InvalidateCache();
         }
     }
+    sheet_.GetStatsCollector().AddInvalidation(invalidated);
 }
 
-bool Cell::TestCyclicDependance(const CellInterface* cell, Position head) const{
-    if(cell == nullptr) { return false;}
+bool Cell::HasCircularDependency(const std::vector<Position>& referenced_cells,
+                                 const std::vector<Rect>& referenced_ranges, Position pos){
+    // Цикл появится, если от этой ячейки по зависимым можно дойти до одной из
+    // новых входных ячеек. Путь идёт по возрастанию порядка, поэтому до входа,
+    // стоящего в порядке раньше этой ячейки, дойти нельзя, а остальные входы
+    // ограничивают глубину поиска сверху.
+    StatsCollector::Counters& counters = sheet_.GetStatsCollector().Local();
+    StatsCollector::Counters::Add(counters.cycle_checks, 1);
+    FlatHashSet<const Cell*> late_inputs;
+    int upper_bound = order_;
+    // у последней в порядке ячейки поздних входов нет, а обход диапазонов
+    // стоит столько, сколько в них ячеек
+    const bool is_last = order_ == sheet_.GetLastOrder();
+    for(Position reference_pos : referenced_cells){
+        if(reference_pos == pos){
+            return true;
+        }
+        const Cell* input = sheet_.FindCell(reference_pos);
+        if(input != nullptr && input->order_ > order_){
+            late_inputs.Insert(input);
+            upper_bound = std::max(upper_bound, input->order_);
+        }
+    }
+    for(Rect range : referenced_ranges){
+        if(range.Contains(pos)){
+            return true;
+        }
+        if(is_last){
+            continue;
+        }
+        sheet_.ForEachCellInRect(range, [&](Position, const Cell& input){
+            if(input.order_ > order_){
+                late_inputs.Insert(&input);
+                upper_bound = std::max(upper_bound, input.order_);
+            }
+        });
+    }
+    if(late_inputs.Empty()){
+        return false;
+    }
 
-    bool res = false;
-    for(const auto& next_cell_pos : cell->GetReferencedCells()) {
-        if(next_cell_pos == head) {
+    const std::vector<Cell*> dependents = CollectDependents(upper_bound, sheet_.NewVisitMark());
+    StatsCollector::Counters::Add(counters.cycle_check_visits, dependents.size());
+    for(const Cell* cell : dependents){
+        if(late_inputs.Contains(cell)){
             return true;
         }
-        res = res || TestCyclicDependance(sheet_.GetCell(next_cell_pos), head);
     }
-    return res;
+    return false;
 }
 
-bool Cell::TestCyclicDependance(const std::vector<Position>& referenced_cells, Position head) const{
-    if(referenced_cells.empty()) { return false;}
+void Cell::RestoreTopologicalOrder(){
+    // Алгоритм Пирса-Келли для новых рёбер input -> this: порядок нарушают только
+    // входы, стоящие позже этой ячейки. Переставляются лишь ячейки между
+    // границами: зависимые этой ячейки (forward) и ячейки, от которых зависят
+    // нарушающие входы (backward). Backward получают меньшие номера из общего
+    // набора, forward - большие, взаимный порядок внутри групп сохраняется.
+    if(order_ == sheet_.GetLastOrder()){
+        return;
+    }
+    std::vector<Cell*> late_inputs;
+    int upper_bound = order_;
+    ForEachInput([&](Cell* input){
+        if(input->order_ > order_){
+            late_inputs.push_back(input);
+            upper_bound = std::max(upper_bound, input->order_);
+        }
+    });
+    if(late_inputs.empty()){
+        return;
+    }
 
-    bool res = false;
-    for(const auto& next_cell_pos : referenced_cells) {
-        if(next_cell_pos == head) {
-            return true;
+    const std::uint32_t mark = sheet_.NewVisitMark();
+    std::vector<Cell*> forward = CollectDependents(upper_bound, mark);
+    std::vector<Cell*> backward = CollectInputs(late_inputs, order_, mark);
+
+    const auto by_order = [](const Cell* lhs, const Cell* rhs){
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<int> orders;
+    orders.reserve(forward.size() + backward.size());
+    for(const Cell* cell : backward){
+        orders.push_back(cell->order_);
+    }
+    for(const Cell* cell : forward){
+        orders.push_back(cell->order_);
+    }
+    std::sort(orders.begin(), orders.end());
+
+    size_t next = 0;
+    for(Cell* cell : backward){
+        cell->order_ = orders[next++];
+    }
+    for(Cell* cell : forward){
+        cell->order_ = orders[next++];
+    }
+}
+
+std::vector<Cell*> Cell::CollectDependents(int upper_bound, std::uint32_t mark){
+    std::vector<Cell*> result;
+    std::vector<Cell*> to_visit{this};
+    visit_mark_ = mark;
+    while(!to_visit.empty()){
+        Cell* cell = to_visit.back();
+        to_visit.pop_back();
+        result.push_back(cell);
+        cell->ForEachDependent([&](Cell* dependent){
+            if(dependent->visit_mark_ != mark && dependent->order_ <= upper_bound){
+                dependent->visit_mark_ = mark;
+                to_visit.push_back(dependent);
+            }
+        });
+    }
+    return result;
+}
+
+std::vector<Cell*> Cell::CollectInputs(const std::vector<Cell*>& seeds, int lower_bound,
+                                       std::uint32_t mark){
+    std::vector<Cell*> result;
+    std::vector<Cell*> to_visit;
+    for(Cell* seed : seeds){
+        if(seed->visit_mark_ != mark){
+            seed->visit_mark_ = mark;
+            to_visit.push_back(seed);
         }
-        res = res || TestCyclicDependance(sheet_.GetCell(next_cell_pos), head);
     }
-    return res;
+    while(!to_visit.empty()){
+        Cell* cell = to_visit.back();
+        to_visit.pop_back();
+        result.push_back(cell);
+        cell->ForEachInput([&](Cell* input){
+            if(input->visit_mark_ != mark && input->order_ > lower_bound){
+                input->visit_mark_ = mark;
+                to_visit.push_back(input);
+            }
+        });
+    }
+    return result;
 }
 
-bool Cell::Empty(){
+bool Cell::Empty() const{
     return is_empty;
 }
\ No newline at end of file
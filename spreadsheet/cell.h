@@ -1,53 +1,202 @@
 #pragma once
 
 #include "common.h"
+#include "flat_hash.h"
 #include "formula.h"
+#include "range_index.h"
+#include "text_pool.h"
 
 
+#include <cstdint>
+#include <memory>
 #include <optional>
-#include <unordered_set>
 #include <vector>
 #include <stack>
 #include <algorithm>
 
 class Sheet;
+enum class InvalidationMode;
 
+// Ячейка хранит в себе только то, что нужно любой ячейке: ссылку на текст
+// в пуле листа, место в порядке и флаги. Формула, её значение, диапазоны и
+// связи в графе зависимостей вынесены в отдельную структуру, которая
+// заводится лишь у ячеек, участвующих в формулах. Поэтому ячейка с текстом
+// не тратит памяти на граф и не выделяет памяти под повторяющийся текст.
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
     void Set(std::string text, Position pos);
     void Clear();
 
+    // Правка ячейки в пакете: новый текст или очистка (text пуст)
+    struct BatchEdit {
+        Cell* cell;
+        std::optional<std::string> text;
+        // ячейка заведена под этот пакет и до него не существовала
+        bool created;
+        // уже разобранная формула ячейки, тогда text не разбирается
+        std::unique_ptr<FormulaInterface> formula = nullptr;
+    };
+    // Применяет правки ячеек одного листа целиком или не применяет вовсе.
+    // Все формулы разбираются до изменений, затем одна проверка на циклы
+    // охватывает все правки сразу, и одним проходом сбрасываются кеши всех
+    // зависимых ячеек. Каждая ячейка встречается в edits не больше раза.
+    // При ошибке разбора бросает FormulaException, при цикле -
+    // CircularDependencyException; ячейки при этом остаются прежними, а
+    // созданные для пакета - пустыми.
+    static void ApplyBatch(std::vector<BatchEdit>& edits);
+
+    // Восстановление из снимка листа, см. Sheet::LoadSnapshot(). Restore()
+    // ставит содержимое (формулу, а без неё текст), место в порядке и кеш
+    // формулы без проверки на циклы и сброса кешей. LinkRestored() связывает ячейку
+    // с её входами, когда заведены все ячейки листа.
+    void Restore(std::unique_ptr<FormulaInterface> formula, std::string text, int order,
+                 std::optional<Value> cached_value, bool empty);
+    void LinkRestored();
+
     Value GetValue() const override;
+    // Возвращает ссылку на закешированное значение, при необходимости вычисляя
+    // его. В отличие от GetValue() не копирует значение.
+    const Value& GetCachedValue() const;
+    // Есть ли в кеше верное сейчас значение. У текстовой и пустой ячейки
+    // значение есть всегда. При ленивом сбросе кеш формулы верен, если
+    // проверен в текущей версии листа.
+    bool HasCachedValue() const;
+    // Версия листа, в которой значение ячейки последний раз изменилось для
+    // зависимых от неё ячеек
+    std::uint64_t GetChangedAt() const;
+    // Значение ячейки как аргумент формулы, см. CellValueToNumber(). Число
+    // из текста разобрано заранее, при записи текста.
+    double GetNumber() const;
+    // Передаёт значение ячейки в свёртку агрегатной функции
+    void AccumulateValue(RangeAccumulator& accumulator) const;
+    // Номер в топологическом порядке листа: ячейка стоит после всех ячеек,
+    // от которых зависит
+    int GetOrder() const;
+    // Новый номер при перенумерации листа, см. Sheet::CompactOrders()
+    void SetOrder(int order);
     std::string GetText() const override;
+    // Пустой текст бывает только у пустой ячейки. В отличие от GetText()
+    // не восстанавливает текст формулы.
+    bool HasText() const;
+    // Формула ячейки или nullptr, если в ячейке не формула
+    const FormulaInterface* GetFormula() const;
 
     std::vector<Position> GetReferencedCells() const override;
+    // Диапазоны из аргументов функций формулы
+    const std::vector<Rect>& GetReferencedRanges() const;
     bool IsReferenced() const;
 
-    std::unordered_set<Cell*>& GetReferencedBy();
-    std::unordered_set<Cell*>& GetReferenceTo();
+    // Вызывает f(Cell*) для ячеек, от которых зависит эта: для ячеек из
+    // ссылок формулы и для существующих ячеек её диапазонов
+    template <typename F>
+    void ForEachInput(F f) const;
+    // Вызывает f(Cell*) для ячеек, зависящих от этой: ссылающихся на неё и
+    // тех, чьи диапазоны её накрывают. Ячейка может встретиться несколько раз.
+    template <typename F>
+    void ForEachDependent(F f) const;
 
-    bool TestCyclicDependance(const CellInterface* cell, Position head) const;
     void InvalidateCacheChilds();
+    // Приводит кеш формулы к способу сброса mode перед его сменой, см.
+    // Sheet::SetInvalidationMode()
+    void AdoptInvalidationMode(InvalidationMode mode);
 
-    bool Empty();
+    bool Empty() const;
 
 private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    enum class Kind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    // Формула ячейки и её связи в графе зависимостей
+    struct Links {
+        std::unique_ptr<FormulaInterface> formula;
+        // вычисленное значение формулы, если has_value_
+        Value value;
+        // версия листа, в которой value последний раз вычислено или
+        // подтверждено по версиям входов
+        std::uint64_t verified_at = 0;
+        std::vector<Rect> referenced_ranges;
+        // записи referenced_ranges в индексе диапазонов листа, в том же порядке
+        std::vector<RangeIndex::Handle> range_handles;
+        // ячейки из ссылок формулы, от которых зависит эта
+        FlatHashSet<Cell*> referenced_by;
+        // ячейки, ссылающиеся на эту
+        FlatHashSet<Cell*> reference_to;
+    };
+
+    // Содержимое ячейки, снятое с неё: новое содержимое при правке или
+    // прежнее, которое возвращается на место при откате пакета
+    struct Content {
+        Kind kind = Kind::Empty;
+        bool escaped = false;
+        bool has_value = true;
+        TextPool::Ref text;
+        Value value;
+        std::unique_ptr<FormulaInterface> formula;
+    };
 
     Sheet& sheet_;
-    std::unique_ptr<Impl> impl_;
-    mutable std::optional<CellInterface::Value> cached_value_;
-    std::vector<Position> referenced_cells_;
-    std::unordered_set<Cell*> referenced_by;
-    std::unordered_set<Cell*> reference_to;
+    Position pos_;
+    // текст без знака экранирования, он же значение текстовой ячейки
+    TextPool::Ref text_;
+    std::unique_ptr<Links> links_;
+    // Место ячейки в поддерживаемом листом топологическом порядке: ячейка
+    // всегда стоит после всех ячеек, от которых зависит. Порядок позволяет
+    // ограничить поиск цикла ячейками между концами нового ребра.
+    int order_;
+    // отметка посещения при обходе графа, см. Sheet::NewVisitMark()
+    std::uint32_t visit_mark_ = 0;
+    // версия листа, в которой значение ячейки последний раз изменилось:
+    // правка содержимого или новое вычисление формулы с другим результатом
+    mutable std::uint64_t changed_at_ = 0;
+    Kind kind_ = Kind::Empty;
+    // текст начинается с ESCAPE_SIGN
+    bool escaped_ = false;
+    mutable bool has_value_ = true;
     bool is_empty = false;
 
-    void InvalidateCache();
-    bool TestCyclicDependance(const std::vector<Position>& referenced_cells, Position head) const;
+    // Сбрасывает кеш формулы; true, если было что сбрасывать
+    bool InvalidateCache();
+    Value Evaluate() const;
+    // Обновляет кеш формулы вместе с кешами всех формул, от которых она
+    // зависит, без рекурсии
+    void Refresh() const;
+    // Обновляет кеш формулы, чьи входы уже обновлены: подтверждает его или
+    // вычисляет формулу заново
+    void UpdateCache() const;
+    // Проверка кеша формулы при ленивом сбросе: если ни один вход не
+    // изменился после прошлой проверки, подтверждает кеш в текущей версии
+    // листа
+    bool ValidateCache() const;
+    Content MakeContent(std::string text, Position pos);
+    // Неотличимо ли для зависимых ячеек содержимое ячейки от прежнего: та же
+    // пустая ячейка или текст с тем же числом или тем же текстом
+    bool SameForDependents(const Content& previous) const;
+    // Была и осталась пустой, например, ячейка-заглушка для ссылки: такая
+    // правка ничего не отсекает, ведь зависимым нечего было пересчитывать
+    bool StaysEmpty(const Content& previous) const;
+    // Отмечает новую версию значения ячейки после правки
+    void MarkChanged();
+    // Ставит новое содержимое и перестраивает связи ячейки, возвращает
+    // прежнее содержимое. Без create_inputs ещё не существующие ячейки из
+    // ссылок не заводятся и не связываются.
+    Content ReplaceContent(Content content, bool create_inputs);
+    void LinkInputs(bool create_inputs);
+    Links& GetLinks();
+    // освобождает связи, если у ячейки нет ни формулы, ни зависимых
+    void ReleaseUnusedLinks();
+    // Ячейки, зависящие от edits, вместе с ними самими в топологическом
+    // порядке или nullopt, если среди них есть цикл
+    static std::optional<std::vector<Cell*>> SortDependents(const std::vector<BatchEdit>& edits);
+    bool HasCircularDependency(const std::vector<Position>& referenced_cells,
+                               const std::vector<Rect>& referenced_ranges, Position pos);
+    void RestoreTopologicalOrder();
+    std::vector<Cell*> CollectDependents(int upper_bound, std::uint32_t mark);
+    static std::vector<Cell*> CollectInputs(const std::vector<Cell*>& seeds, int lower_bound,
+                                            std::uint32_t mark);
 };
\ No newline at end of file
@@ -0,0 +1,70 @@
+#include "cell_storage.h"
+
+CellStorage::CellStorage()
+    : bands_(ROW_TILES),
+      band_width_(ROW_TILES, 0) {}
+
+Cell* CellStorage::Find(Position pos) const {
+    const auto& band = bands_[pos.row / TILE_SIZE];
+    if (!band) {
+        return nullptr;
+    }
+    return (*band)[pos.col / TILE_SIZE].Find(Offset(pos));
+}
+
+Cell* CellStorage::Insert(Position pos, Cell_ptr cell) {
+    auto& band = bands_[pos.row / TILE_SIZE];
+    if (!band) {
+        band = std::make_unique<Band>();
+    }
+
+    int& width = band_width_[pos.row / TILE_SIZE];
+    width = std::max(width, pos.col / TILE_SIZE + 1);
+
+    Cell* result = cell.get();
+    (*band)[pos.col / TILE_SIZE].Insert(Offset(pos), std::move(cell));
+    ++cell_count_;
+    return result;
+}
+
+size_t CellStorage::GetCellCount() const {
+    return cell_count_;
+}
+
+Cell* CellStorage::Tile::Find(int offset) const {
+    if (dense) {
+        return (*dense)[offset].get();
+    }
+
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), offset,
+                               [](const SparseEntry& entry, int value) {
+                                   return entry.first < value;
+                               });
+    if (it == sparse.end() || it->first != offset) {
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+void CellStorage::Tile::Insert(int offset, Cell_ptr cell) {
+    if (!dense && sparse.size() >= SPARSE_LIMIT) {
+        // тайл заполнился - переносим ячейки в плотный массив
+        dense = std::make_unique<std::array<Cell_ptr, TILE_AREA>>();
+        for (auto& [entry_offset, entry_cell] : sparse) {
+            (*dense)[entry_offset] = std::move(entry_cell);
+        }
+        sparse.clear();
+        sparse.shrink_to_fit();
+    }
+
+    if (dense) {
+        (*dense)[offset] = std::move(cell);
+        return;
+    }
+
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), offset,
+                               [](const SparseEntry& entry, int value) {
+                                   return entry.first < value;
+                               });
+    sparse.emplace(it, static_cast<std::uint16_t>(offset), std::move(cell));
+}
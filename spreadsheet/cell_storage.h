@@ -0,0 +1,191 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using Cell_ptr = std::unique_ptr<Cell>;
+
+// Хранилище ячеек листа. Лист разбит на квадратные блоки (тайлы)
+// TILE_SIZE x TILE_SIZE, которые выделяются при первой записи в их область.
+// Пока в тайле мало ячеек, он хранит их в упорядоченном по смещению векторе
+// (разреженный режим), поэтому сильно разбросанные по листу ячейки не тянут
+// за собой целые блоки. При заполнении тайл переходит на плотный массив.
+// Поиск по позиции выполняется за O(1), обход идёт построчно.
+class CellStorage {
+public:
+    static constexpr int TILE_SIZE = 64;
+    // максимальное число ячеек в разреженном тайле
+    static constexpr size_t SPARSE_LIMIT = 128;
+
+    CellStorage();
+
+    Cell* Find(Position pos) const;
+    // Кладёт ячейку в позицию, в которой ещё нет ячейки
+    Cell* Insert(Position pos, Cell_ptr cell);
+
+    size_t GetCellCount() const;
+
+    // Вызывает f(col, cell) для всех ячеек строки row в порядке возрастания
+    // столбца
+    template <typename F>
+    void ForEachInRow(int row, F f) const;
+
+    // Вызывает f(pos, cell) для всех ячеек листа построчно
+    template <typename F>
+    void ForEach(F f) const;
+
+    // Вызывает f(pos, cell) для ячеек прямоугольника. Ячейки обходятся по
+    // тайлам, а не построчно по всей области: так каждый тайл просматривается
+    // один раз. Обходятся только выделенные тайлы, пустая часть области
+    // ничего не стоит.
+    template <typename F>
+    void ForEachInRect(Rect rect, F f) const;
+
+private:
+    static constexpr int TILE_AREA = TILE_SIZE * TILE_SIZE;
+    static constexpr int ROW_TILES = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int COL_TILES = Position::MAX_COLS / TILE_SIZE;
+
+    using SparseEntry = std::pair<std::uint16_t, Cell_ptr>;
+
+    struct Tile {
+        std::unique_ptr<std::array<Cell_ptr, TILE_AREA>> dense;
+        std::vector<SparseEntry> sparse;
+
+        Cell* Find(int offset) const;
+        void Insert(int offset, Cell_ptr cell);
+
+        // обходит столбцы [col_begin, col_end) строки тайла
+        template <typename F>
+        void ForEachInRow(int tile_row, int first_col, int col_begin, int col_end, F& f) const;
+        // обходит строки [row_begin, row_end) и столбцы [col_begin, col_end)
+        // тайла, first - позиция его левой верхней ячейки
+        template <typename F>
+        void ForEachInRect(Position first, int row_begin, int row_end, int col_begin,
+                           int col_end, F& f) const;
+    };
+
+    // полоса тайлов, покрывающая TILE_SIZE строк листа
+    using Band = std::array<Tile, COL_TILES>;
+
+    std::vector<std::unique_ptr<Band>> bands_;
+    // ширина занятой части каждой полосы в тайлах
+    std::vector<int> band_width_;
+    size_t cell_count_ = 0;
+
+    static int Offset(Position pos) {
+        return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+};
+
+template <typename F>
+void CellStorage::Tile::ForEachInRow(int tile_row, int first_col, int col_begin, int col_end,
+                                     F& f) const {
+    if (dense) {
+        const Cell_ptr* row = dense->data() + tile_row * TILE_SIZE;
+        for (int col = col_begin; col < col_end; ++col) {
+            if (row[col]) {
+                f(first_col + col, *row[col]);
+            }
+        }
+        return;
+    }
+
+    const auto range_begin = static_cast<std::uint16_t>(tile_row * TILE_SIZE + col_begin);
+    const int range_end = tile_row * TILE_SIZE + col_end;
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), range_begin,
+                               [](const SparseEntry& entry, std::uint16_t offset) {
+                                   return entry.first < offset;
+                               });
+    for (; it != sparse.end() && it->first < range_end; ++it) {
+        f(first_col + it->first % TILE_SIZE, *it->second);
+    }
+}
+
+template <typename F>
+void CellStorage::ForEachInRow(int row, F f) const {
+    const auto& band = bands_[row / TILE_SIZE];
+    if (!band) {
+        return;
+    }
+    const int tile_row = row % TILE_SIZE;
+    for (int tile_col = 0; tile_col < band_width_[row / TILE_SIZE]; ++tile_col) {
+        (*band)[tile_col].ForEachInRow(tile_row, tile_col * TILE_SIZE, 0, TILE_SIZE, f);
+    }
+}
+
+template <typename F>
+void CellStorage::ForEach(F f) const {
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        if (!bands_[row / TILE_SIZE]) {
+            row += TILE_SIZE - 1;
+            continue;
+        }
+        ForEachInRow(row, [&f, row](int col, Cell& cell) {
+            f(Position{row, col}, cell);
+        });
+    }
+}
+
+template <typename F>
+void CellStorage::Tile::ForEachInRect(Position first, int row_begin, int row_end, int col_begin,
+                                      int col_end, F& f) const {
+    if (dense) {
+        for (int row = row_begin; row < row_end; ++row) {
+            const Cell_ptr* cells = dense->data() + row * TILE_SIZE;
+            for (int col = col_begin; col < col_end; ++col) {
+                if (cells[col]) {
+                    f(Position{first.row + row, first.col + col}, *cells[col]);
+                }
+            }
+        }
+        return;
+    }
+
+    // ячейки разреженного тайла упорядочены построчно, область в нём -
+    // отрезок смещений, из которого отбрасываются чужие столбцы
+    const auto range_begin = static_cast<std::uint16_t>(row_begin * TILE_SIZE + col_begin);
+    const int range_end = (row_end - 1) * TILE_SIZE + col_end;
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), range_begin,
+                               [](const SparseEntry& entry, std::uint16_t offset) {
+                                   return entry.first < offset;
+                               });
+    for (; it != sparse.end() && it->first < range_end; ++it) {
+        const int col = it->first % TILE_SIZE;
+        if (col_begin <= col && col < col_end) {
+            f(Position{first.row + it->first / TILE_SIZE, first.col + col}, *it->second);
+        }
+    }
+}
+
+template <typename F>
+void CellStorage::ForEachInRect(Rect rect, F f) const {
+    const int first_band = rect.top_left.row / TILE_SIZE;
+    const int last_band = rect.bottom_right.row / TILE_SIZE;
+    const int first_tile_col = rect.top_left.col / TILE_SIZE;
+    for (int band_index = first_band; band_index <= last_band; ++band_index) {
+        const auto& band = bands_[band_index];
+        if (!band) {
+            continue;
+        }
+        const int first_row = band_index * TILE_SIZE;
+        const int row_begin = std::max(rect.top_left.row - first_row, 0);
+        const int row_end = std::min(rect.bottom_right.row - first_row + 1, TILE_SIZE);
+        const int end_tile_col = std::min(rect.bottom_right.col / TILE_SIZE + 1,
+                                          band_width_[band_index]);
+        for (int tile_col = first_tile_col; tile_col < end_tile_col; ++tile_col) {
+            const int first_col = tile_col * TILE_SIZE;
+            const int col_begin = std::max(rect.top_left.col - first_col, 0);
+            const int col_end = std::min(rect.bottom_right.col - first_col + 1, TILE_SIZE);
+            (*band)[tile_col].ForEachInRect({first_row, first_col}, row_begin, row_end,
+                                            col_begin, col_end, f);
+        }
+    }
+}
@@ -33,6 +33,23 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область листа. Обе угловые ячейки входят в область.
+struct Rect {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(Rect rhs) const;
+    bool operator<(Rect rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // Запись вида "A1:B2", пустая строка для некорректной области
+    std::string ToString() const;
+
+    // Область с углами a и b, заданными в любом порядке
+    static Rect FromCorners(Position a, Position b);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Хеш-таблица с открытой адресацией для ключей-указателей: ячеек графа
+// зависимостей, деревьев формул. Все элементы лежат в одном массиве, без
+// отдельного узла на каждый, поэтому вставка не выделяет память, а поиск
+// читает соседние слоты. Коллизии разрешаются линейным пробированием, при
+// удалении хвост цепочки сдвигается назад, так что надгробий не бывает.
+// Пустой слот - нулевой указатель, поэтому nullptr ключом быть не может.
+// Любая вставка и удаление делают итераторы недействительными.
+template <typename Key, typename Slot>
+class FlatHashTable {
+    static_assert(std::is_pointer_v<Key>);
+
+public:
+    class Iterator {
+    public:
+        Iterator(const Slot* slot, const Slot* end)
+            : slot_(slot),
+              end_(end) {
+            SkipEmpty();
+        }
+
+        const Slot& operator*() const {
+            return *slot_;
+        }
+        const Slot* operator->() const {
+            return slot_;
+        }
+
+        Iterator& operator++() {
+            ++slot_;
+            SkipEmpty();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return slot_ == other.slot_;
+        }
+        bool operator!=(const Iterator& other) const {
+            return slot_ != other.slot_;
+        }
+
+    private:
+        const Slot* slot_;
+        const Slot* end_;
+
+        void SkipEmpty() {
+            while (slot_ != end_ && KeyOf(*slot_) == nullptr) {
+                ++slot_;
+            }
+        }
+    };
+
+    FlatHashTable() = default;
+
+    FlatHashTable(FlatHashTable&& other) noexcept
+        : slots_(std::move(other.slots_)),
+          size_(std::exchange(other.size_, 0)),
+          capacity_(std::exchange(other.capacity_, 0)) {}
+
+    FlatHashTable& operator=(FlatHashTable&& other) noexcept {
+        slots_ = std::move(other.slots_);
+        size_ = std::exchange(other.size_, 0);
+        capacity_ = std::exchange(other.capacity_, 0);
+        return *this;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    Iterator begin() const {
+        return Iterator(slots_.get(), slots_.get() + capacity_);
+    }
+
+    Iterator end() const {
+        const Slot* end = slots_.get() + capacity_;
+        return Iterator(end, end);
+    }
+
+    bool Contains(Key key) const {
+        return FindSlot(key) != nullptr;
+    }
+
+    // false, если ключа не было
+    bool Erase(Key key) {
+        Slot* slot = FindSlot(key);
+        if (slot == nullptr) {
+            return false;
+        }
+        const std::uint32_t mask = capacity_ - 1;
+        std::uint32_t hole = static_cast<std::uint32_t>(slot - slots_.get());
+        for (std::uint32_t index = (hole + 1) & mask; KeyOf(slots_[index]) != nullptr;
+             index = (index + 1) & mask) {
+            // элемент может занять дыру, если она лежит между его домашним
+            // слотом и текущим
+            const std::uint32_t home = Home(KeyOf(slots_[index]));
+            if (((index - home) & mask) >= ((index - hole) & mask)) {
+                slots_[hole] = std::move(slots_[index]);
+                hole = index;
+            }
+        }
+        slots_[hole] = Slot{};
+        --size_;
+        return true;
+    }
+
+    // Удаляет все элементы, оставляя память под них
+    void Clear() {
+        std::fill(slots_.get(), slots_.get() + capacity_, Slot{});
+        size_ = 0;
+    }
+
+    // Готовит место под count элементов без перестроения таблицы
+    void Reserve(size_t count) {
+        if (count * 4 > static_cast<size_t>(capacity_) * 3) {
+            Rehash(CapacityFor(count));
+        }
+    }
+
+protected:
+    // слот ключа, вставленный пустым, если ключа не было
+    std::pair<Slot*, bool> InsertKey(Key key) {
+        assert(key != nullptr);
+        if ((static_cast<size_t>(size_) + 1) * 4 > static_cast<size_t>(capacity_) * 3) {
+            Rehash(CapacityFor(static_cast<size_t>(size_) + 1));
+        }
+        const std::uint32_t mask = capacity_ - 1;
+        for (std::uint32_t index = Home(key);; index = (index + 1) & mask) {
+            const Key slot_key = KeyOf(slots_[index]);
+            if (slot_key == key) {
+                return {&slots_[index], false};
+            }
+            if (slot_key == nullptr) {
+                SetKey(slots_[index], key);
+                ++size_;
+                return {&slots_[index], true};
+            }
+        }
+    }
+
+    Slot* FindSlot(Key key) const {
+        if (size_ == 0) {
+            return nullptr;
+        }
+        const std::uint32_t mask = capacity_ - 1;
+        for (std::uint32_t index = Home(key);; index = (index + 1) & mask) {
+            const Key slot_key = KeyOf(slots_[index]);
+            if (slot_key == key) {
+                return &slots_[index];
+            }
+            if (slot_key == nullptr) {
+                return nullptr;
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint32_t MIN_CAPACITY = 4;
+
+    std::unique_ptr<Slot[]> slots_;
+    std::uint32_t size_ = 0;
+    // степень двойки, таблица заполнена не больше чем на три четверти
+    std::uint32_t capacity_ = 0;
+
+    static Key KeyOf(const Key& slot) {
+        return slot;
+    }
+    template <typename Value>
+    static Key KeyOf(const std::pair<Key, Value>& slot) {
+        return slot.first;
+    }
+
+    static void SetKey(Key& slot, Key key) {
+        slot = key;
+    }
+    template <typename Value>
+    static void SetKey(std::pair<Key, Value>& slot, Key key) {
+        slot.first = key;
+    }
+
+    static std::uint32_t CapacityFor(size_t count) {
+        std::uint32_t capacity = MIN_CAPACITY;
+        while (static_cast<size_t>(capacity) * 3 < count * 4) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // Домашний слот ключа. Младшие биты указателя почти всегда нули из-за
+    // выравнивания, поэтому адрес перемешивается умножением Фибоначчи и
+    // берутся старшие биты произведения.
+    std::uint32_t Home(Key key) const {
+        const auto address = reinterpret_cast<std::uintptr_t>(key);
+        const auto mixed = static_cast<std::uint64_t>(address) * 0x9E3779B97F4A7C15ull;
+        return static_cast<std::uint32_t>(mixed >> 32) & (capacity_ - 1);
+    }
+
+    void Rehash(std::uint32_t capacity) {
+        std::unique_ptr<Slot[]> old_slots = std::exchange(slots_, std::make_unique<Slot[]>(capacity));
+        const std::uint32_t old_capacity = std::exchange(capacity_, capacity);
+        const std::uint32_t mask = capacity_ - 1;
+        for (std::uint32_t i = 0; i < old_capacity; ++i) {
+            if (KeyOf(old_slots[i]) == nullptr) {
+                continue;
+            }
+            std::uint32_t index = Home(KeyOf(old_slots[i]));
+            while (KeyOf(slots_[index]) != nullptr) {
+                index = (index + 1) & mask;
+            }
+            slots_[index] = std::move(old_slots[i]);
+        }
+    }
+};
+
+// Множество указателей
+template <typename Key>
+class FlatHashSet : public FlatHashTable<Key, Key> {
+public:
+    // false, если ключ уже был
+    bool Insert(Key key) {
+        return this->InsertKey(key).second;
+    }
+};
+
+// Отображение указателей в значения. Значение пустого слота создаётся
+// конструктором по умолчанию.
+template <typename Key, typename Value>
+class FlatHashMap : public FlatHashTable<Key, std::pair<Key, Value>> {
+public:
+    // значение ключа и true, если ключ добавлен
+    std::pair<Value*, bool> Emplace(Key key, Value value) {
+        const auto [slot, inserted] = this->InsertKey(key);
+        if (inserted) {
+            slot->second = std::move(value);
+        }
+        return {&slot->second, inserted};
+    }
+
+    Value& operator[](Key key) {
+        return this->InsertKey(key).first->second;
+    }
+
+    Value* Find(Key key) {
+        auto* slot = this->FindSlot(key);
+        return slot != nullptr ? &slot->second : nullptr;
+    }
+
+    const Value* Find(Key key) const {
+        const auto* slot = this->FindSlot(key);
+        return slot != nullptr ? &slot->second : nullptr;
+    }
+};
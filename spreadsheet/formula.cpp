@@ -5,6 +5,10 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
 #include <sstream>
 
 using namespace std::literals;
@@ -40,44 +44,151 @@ std::string_view FormulaError::ToString() const{
     return "";
 }
 
+std::optional<double> ParseTextNumber(std::string_view text) {
+    // istream пропускает пробелы в начале и принимает плюс, from_chars - нет
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+    if (!text.empty() && text.front() == '+') {
+        text.remove_prefix(1);
+        if (!text.empty() && text.front() == '-') {
+            return std::nullopt;
+        }
+    }
+    // from_chars понимает ещё inf и nan, которых нет у istream
+    const size_t first_digit = !text.empty() && text.front() == '-' ? 1 : 0;
+    if (first_digit >= text.size()
+        || !(std::isdigit(static_cast<unsigned char>(text[first_digit]))
+             || text[first_digit] == '.')) {
+        return std::nullopt;
+    }
+
+    double value = 0;
+    const char* end = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (ptr != end) {
+        return std::nullopt;
+    }
+    if (ec == std::errc::result_out_of_range) {
+        // слишком маленькое число istream делает нулём или денормализованным,
+        // а слишком большое считает ошибкой
+        value = std::strtod(std::string(text).c_str(), nullptr);
+        return std::isinf(value) ? std::nullopt : std::optional<double>(value);
+    }
+    if (ec != std::errc()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+double CellValueToNumber(const CellInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    if (const std::string* text = std::get_if<std::string>(&value)) {
+        if (text->empty()) {
+            return 0;
+        }
+        if (std::optional<double> number = ParseTextNumber(*text)) {
+            return *number;
+        }
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    throw std::get<FormulaError>(value);
+}
+
+RangeAccumulator::RangeAccumulator(bool count_only)
+    : count_only_(count_only) {}
+
+void RangeAccumulator::Add(const double* values, size_t count) {
+    // Независимые потоки накопления не зависят друг от друга по данным,
+    // поэтому цикл выполняется векторными инструкциями, а не по одному
+    // числу за раз.
+    constexpr size_t LANES = 4;
+    double sum[LANES] = {};
+    double min[LANES];
+    double max[LANES];
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        min[lane] = totals_.min;
+        max[lane] = totals_.max;
+    }
+
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            const double value = values[i + lane];
+            sum[lane] += value;
+            min[lane] = value < min[lane] ? value : min[lane];
+            max[lane] = value > max[lane] ? value : max[lane];
+        }
+    }
+    for (; i < count; ++i) {
+        sum[0] += values[i];
+        min[0] = std::min(min[0], values[i]);
+        max[0] = std::max(max[0], values[i]);
+    }
+
+    totals_.sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    totals_.min = std::min({min[0], min[1], min[2], min[3]});
+    totals_.max = std::max({max[0], max[1], max[2], max[3]});
+    totals_.count += count;
+}
+
+const RangeAccumulator::Totals& RangeAccumulator::Finish() {
+    Flush();
+    return totals_;
+}
+
+void RangeAccumulator::AddNonNumber(const CellInterface::Value& value) {
+    if (const std::string* text = std::get_if<std::string>(&value); text && text->empty()) {
+        return;
+    }
+    try {
+        Add(CellValueToNumber(value));
+    }
+    catch (const FormulaError&) {
+        if (!count_only_) {
+            throw;
+        }
+    }
+}
+
+void RangeAccumulator::Flush() {
+    Add(buffer_, size_);
+    size_ = 0;
+}
+
 namespace {
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(const std::string& expression) try :
-        ast_(ParseFormulaAST(expression))
-        {}
-    catch(const FormulaException& err){
-        throw err;
-    }
+    Formula(std::shared_ptr<const FormulaAST> ast, Position shift)
+        : ast_(std::move(ast)),
+          shift_(shift) {}
 
     Value Evaluate(const SheetInterface& sheet) const override {
-
-        const SheetArgs args = [&sheet](const Position p) -> double {
+        const auto resolve = [&sheet](const Position p) -> double {
             if (!p.IsValid()) { throw FormulaError(FormulaError::Category::Ref);}
-            
+
             const auto* cell = sheet.GetCell(p);
             if (!cell) { return 0.0;}
 
-            if (std::holds_alternative<double>(cell->GetValue())) {
-                return std::get<double>(cell->GetValue());
-            }
-
-            if (std::holds_alternative<std::string>(cell->GetValue())) {
-                auto value = std::get<std::string>(cell->GetValue());
-                double result = 0;
-                if (!value.empty()) {
-                    std::istringstream in(value);
-                    if (!(in >> result) || !in.eof()) {
-                        throw FormulaError(FormulaError::Category::Value);
+            return CellValueToNumber(cell->GetValue());
+        };
+        const auto read_range = [&sheet](Rect range, RangeAccumulator& accumulator) {
+            for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                    if (const auto* cell = sheet.GetCell({row, col})) {
+                        accumulator.Add(cell->GetValue());
                     }
                 }
-                return result;
             }
-            throw FormulaError(std::get<FormulaError>(cell->GetValue()));
         };
+        return Evaluate(SheetArgs(resolve, read_range));
+    }
 
+    Value Evaluate(const SheetArgs& args) const override {
         try {
-            return ast_.Execute(args);
+            return ast_->Execute(args, shift_);
         }
         catch (FormulaError& fe) {
             return FormulaError(fe.GetCategory());
@@ -86,30 +197,132 @@ public:
 
     std::string GetExpression() const override {
         std::ostringstream os;
-        ast_.PrintFormula(os);
+        ast_->PrintFormula(os, shift_);
         return os.str();
     }
 
     std::vector<Position> GetReferencedCells() const{
-        std::vector<Position> result{};
-        for (auto cell : ast_.GetCells()) {
-            if (cell.IsValid()) {
-                result.push_back(cell);
-            }
+        // сдвиг сохраняет порядок, список остаётся отсортированным
+        const auto shared_cells = ast_->GetCells();
+        std::vector<Position> cells(shared_cells.begin(), shared_cells.end());
+        for (Position& cell : cells) {
+            cell = ShiftPosition(cell, shift_);
+        }
+        return cells;
+    }
+
+    std::vector<Rect> GetReferencedRanges() const override {
+        const auto shared_ranges = ast_->GetRanges();
+        std::vector<Rect> ranges(shared_ranges.begin(), shared_ranges.end());
+        for (Rect& range : ranges) {
+            range = ShiftRect(range, shift_);
         }
-        result.resize(std::unique(result.begin(), result.end()) - result.begin());
-        return result;
+        return ranges;
+    }
+
+    SharedFormula GetShared() const {
+        return {ast_, shift_};
     }
 private:
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_;
+    Position shift_;
 };
-}  // namespace
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+std::shared_ptr<const FormulaAST> ParseSharedAST(std::string_view expression) {
     try {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_shared<const FormulaAST>(
+            ParseFormulaAST(expression, GetFormulaParser()));
     }
     catch (...) {
         throw FormulaException("");
     }
+}
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(ParseSharedAST(expression), Position{0, 0});
+}
+
+SharedFormula GetSharedFormula(const FormulaInterface& formula) {
+    return dynamic_cast<const Formula&>(formula).GetShared();
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(SharedFormula formula) {
+    return std::make_unique<Formula>(std::move(formula.ast), formula.shift);
+}
+
+FormulaPool::FormulaPool() = default;
+
+FormulaPool::~FormulaPool() = default;
+
+std::unique_ptr<FormulaInterface> FormulaPool::Parse(std::string_view expression,
+                                                     Position anchor) {
+    std::optional<std::string> shape = GetFormulaShape(expression, anchor);
+    if (!shape) {
+        // такая формула не разбирается, ParseSharedAST() бросит исключение
+        return std::make_unique<Formula>(ParseSharedAST(expression), Position{0, 0});
+    }
+
+    if (std::optional<Entry> entry = FindShape(*shape)) {
+        const Position shift{anchor.row - entry->anchor.row, anchor.col - entry->anchor.col};
+        return std::make_unique<Formula>(std::move(entry->ast), shift);
+    }
+
+    auto ast = ParseSharedAST(expression);
+    std::lock_guard lock(mutex_);
+    if (shapes_.size() >= purge_threshold_) {
+        PurgeUnused();
+    }
+    // пока шёл разбор, ту же форму мог добавить другой поток
+    auto [it, inserted] = shapes_.emplace(std::move(*shape), Entry{ast, anchor});
+    if (!inserted) {
+        const Entry& entry = it->second;
+        const Position shift{anchor.row - entry.anchor.row, anchor.col - entry.anchor.col};
+        return std::make_unique<Formula>(entry.ast, shift);
+    }
+    return std::make_unique<Formula>(std::move(ast), Position{0, 0});
+}
+
+void FormulaPool::Adopt(std::string shape, std::shared_ptr<const FormulaAST> ast,
+                        Position anchor) {
+    std::lock_guard lock(mutex_);
+    if (shapes_.size() >= purge_threshold_) {
+        PurgeUnused();
+    }
+    shapes_.emplace(std::move(shape), Entry{std::move(ast), anchor});
+}
+
+size_t FormulaPool::GetShapeCount() const {
+    std::lock_guard lock(mutex_);
+    return shapes_.size();
+}
+
+std::unordered_map<const FormulaAST*, std::string> FormulaPool::GetShapes() const {
+    std::lock_guard lock(mutex_);
+    std::unordered_map<const FormulaAST*, std::string> shapes;
+    shapes.reserve(shapes_.size());
+    for (const auto& [shape, entry] : shapes_) {
+        shapes.emplace(entry.ast.get(), shape);
+    }
+    return shapes;
+}
+
+std::optional<FormulaPool::Entry> FormulaPool::FindShape(const std::string& shape) const {
+    std::lock_guard lock(mutex_);
+    if (auto it = shapes_.find(shape); it != shapes_.end()) {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+void FormulaPool::PurgeUnused() {
+    for (auto it = shapes_.begin(); it != shapes_.end();) {
+        if (it->second.ast.use_count() == 1) {
+            it = shapes_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // порог растёт вместе с пулом, так что очистка занимает амортизированно O(1)
+    purge_threshold_ = std::max(MIN_PURGE_THRESHOLD, shapes_.size() * 2);
 }
\ No newline at end of file
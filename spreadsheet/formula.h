@@ -2,13 +2,124 @@
 
 #include "common.h"
 
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+class FormulaAST;
+
+// Свёртка значений для агрегатных функций SUM, AVERAGE, MIN, MAX и COUNT.
+// Лист передаёт в Add() значения существующих ячеек диапазона, пустые
+// значения пропускаются. Хранилище листа держит ячейки, а не числа, поэтому
+// значения собираются по одному в буфер, и это основная часть стоимости.
+// Векторизована только свёртка: подряд лежащий массив обрабатывается в
+// несколько независимых потоков накопления, которые компилятор переводит в
+// векторные инструкции.
+class RangeAccumulator {
+public:
+    struct Totals {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        size_t count = 0;
+    };
+
+    // При count_only значения, которые нельзя трактовать как число,
+    // пропускаются (так работает COUNT), иначе их ошибка бросается как
+    // FormulaError.
+    explicit RangeAccumulator(bool count_only = false);
+
+    void Add(const CellInterface::Value& value) {
+        if (const double* number = std::get_if<double>(&value)) {
+            Add(*number);
+        } else {
+            AddNonNumber(value);
+        }
+    }
+
+    void Add(double value) {
+        buffer_[size_++] = value;
+        if (size_ == BUFFER_SIZE) {
+            Flush();
+        }
+    }
+
+    void Add(const double* values, size_t count);
+
+    // Итоги по всем добавленным значениям
+    const Totals& Finish();
+
+private:
+    static constexpr size_t BUFFER_SIZE = 256;
+
+    bool count_only_;
+    size_t size_ = 0;
+    Totals totals_;
+    double buffer_[BUFFER_SIZE];
+
+    void AddNonNumber(const CellInterface::Value& value);
+    void Flush();
+};
+
+// Невладеющий доступ формулы к ячейкам листа: функция double(Position), по
+// которой формула получает числовые значения ячеек, и функция
+// void(Rect, RangeAccumulator&), передающая значения ячеек области. В
+// отличие от std::function не выделяет память и не копирует вызываемые
+// объекты: хранит только указатели на них и на функции-переходники.
+// Вызываемые объекты должны жить дольше SheetArgs.
+class SheetArgs {
+public:
+    template <typename F, typename G>
+    SheetArgs(const F& resolver, const G& range_reader)
+        : resolver_(&resolver),
+          resolve_([](const void* context, Position pos) -> double {
+              return (*static_cast<const F*>(context))(pos);
+          }),
+          range_reader_(&range_reader),
+          read_range_([](const void* context, Rect range, RangeAccumulator& accumulator) {
+              (*static_cast<const G*>(context))(range, accumulator);
+          }) {}
+
+    double operator()(Position pos) const {
+        return resolve_(resolver_, pos);
+    }
+
+    void ReadRange(Rect range, RangeAccumulator& accumulator) const {
+        read_range_(range_reader_, range, accumulator);
+    }
+
+private:
+    const void* resolver_;
+    double (*resolve_)(const void* context, Position pos);
+    const void* range_reader_;
+    void (*read_range_)(const void* context, Rect range, RangeAccumulator& accumulator);
+};
+
+// Число, записанное текстом ячейки, как его читает istream >> double: с
+// пробелами в начале, но не в конце, со знаком плюс или минус. nullopt, если
+// текст не число целиком или число не помещается в double. Разбирает
+// std::from_chars, без потоков и локали.
+std::optional<double> ParseTextNumber(std::string_view text);
+
+// Переводит значение ячейки в аргумент формулы. Число возвращается как есть,
+// текст трактуется как число (пустой текст - ноль), иначе бросается
+// FormulaError с категорией Value. Ошибка вычисления ячейки бросается как есть.
+double CellValueToNumber(const CellInterface::Value& value);
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над числами и диапазонами: SUM(A1:A10, B2*2),
+//   AVERAGE, MIN, MAX, COUNT. Ссылка на ячейку в аргументе функции
+//   читается как диапазон из одной ячейки: пустые ячейки пропускаются,
+//   COUNT пропускает и текст без числа, и ошибки.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -26,6 +137,10 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // То же, но значения ячеек формула получает через args. Позволяет таблице
+    // читать свои ячейки напрямую, без виртуальных вызовов и копирования значений.
+    virtual Value Evaluate(const SheetArgs& args) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
@@ -34,8 +149,69 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны из аргументов функций. Их ячейки не входят в
+    // GetReferencedCells(). Список отсортирован и не содержит повторов.
+    virtual std::vector<Rect> GetReferencedRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Общее дерево формулы и сдвиг её ячейки относительно ячейки, где оно было
+// разобрано (см. FormulaPool)
+struct SharedFormula {
+    std::shared_ptr<const FormulaAST> ast;
+    Position shift;
+};
+
+// formula должна быть создана ParseFormula(), FormulaPool или MakeFormula()
+SharedFormula GetSharedFormula(const FormulaInterface& formula);
+std::unique_ptr<FormulaInterface> MakeFormula(SharedFormula formula);
+
+// Общие скомпилированные формулы листа. Формулы, которые отличаются только
+// ячейкой, где они записаны (=B2*C2 в D2, =B3*C3 в D3 и т.д.), имеют одинаковую
+// форму: ссылки в ней заменены смещениями от ячейки формулы. Для каждой формы
+// дерево разбирается и компилируется один раз, а объект формулы хранит
+// только общее дерево и сдвиг своей ячейки относительно ячейки, где оно
+// было разобрано. Parse() можно вызывать из нескольких потоков: под
+// блокировкой выполняется только поиск формы, разбор идёт без неё.
+class FormulaPool {
+public:
+    FormulaPool();
+    ~FormulaPool();
+
+    // То же, что ParseFormula(), для формулы, записанной в ячейке anchor
+    std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position anchor);
+
+    // Добавляет готовое дерево формы shape (см. GetFormulaShape()),
+    // разобранное для ячейки anchor, например, прочитанное из снимка листа.
+    // Если такая форма уже есть, пул не меняется.
+    void Adopt(std::string shape, std::shared_ptr<const FormulaAST> ast, Position anchor);
+
+    // число форм в пуле, включая ещё не удалённые неиспользуемые
+    size_t GetShapeCount() const;
+    // Формы деревьев пула по их адресам. Форму нельзя восстановить по
+    // тексту дерева: PrintFormula() округляет числа, и у разных форм мог бы
+    // оказаться один текст.
+    std::unordered_map<const FormulaAST*, std::string> GetShapes() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<const FormulaAST> ast;
+        // ячейка, для которой разобрано дерево
+        Position anchor;
+    };
+
+    // при таком числе форм из пула удаляются те, что больше не используются
+    static constexpr size_t MIN_PURGE_THRESHOLD = 1024;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> shapes_;
+    size_t purge_threshold_ = MIN_PURGE_THRESHOLD;
+
+    std::optional<Entry> FindShape(const std::string& shape) const;
+    // вызывается под mutex_
+    void PurgeUnused();
+};
\ No newline at end of file
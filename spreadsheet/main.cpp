@@ -1,7 +1,23 @@
+#include <algorithm>
 #include <limits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "FormulaAST.h"
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -46,6 +62,888 @@ void TestClearPrint() {
         PrintSheet(sheet, std::cout);
     }
 }
+
+// Выбирает парсер формул на время теста
+class FormulaParserScope {
+public:
+    explicit FormulaParserScope(FormulaParserKind kind)
+        : previous_(GetFormulaParser()) {
+        SetFormulaParser(kind);
+    }
+    ~FormulaParserScope() {
+        SetFormulaParser(previous_);
+    }
+
+private:
+    FormulaParserKind previous_;
+};
+
+// Грамматика Formula.g4 на примерах: каждый встроенный парсер должен
+// разбирать их одинаково
+void TestParserCorpus() {
+    // выражение и его запись GetExpression()
+    const std::pair<std::string, std::string> valid[] = {
+        // приоритет и ассоциативность операций
+        {"1+2*3", "1+2*3"},
+        {"(1+2)*3", "(1+2)*3"},
+        {"1-2-3", "1-2-3"},
+        {"(1-2)-3", "1-2-3"},
+        {"1-(2-3)", "1-(2-3)"},
+        {"1/2*3", "1/2*3"},
+        {"1/(2*3)", "1/(2*3)"},
+        {"2*(3/4)", "2*3/4"},
+        {"2/(3/4)", "2/(3/4)"},
+        // цепочки унарных знаков
+        {"-1", "-1"},
+        {"--1", "--1"},
+        {"+-+1", "+-+1"},
+        {"1--1", "1--1"},
+        {"1*-2", "1*-2"},
+        {"-(-(1))", "--1"},
+        {"-(1+2)", "-(1+2)"},
+        {"-(2*3)", "-2*3"},
+        {"-A1*2", "-A1*2"},
+        // числа с дробной частью и порядком
+        {"1e3", "1000"},
+        {"1E+3", "1000"},
+        {"1.5e-2", "0.015"},
+        {".5", "0.5"},
+        {".5e2", "50"},
+        // функции, ячейки и диапазоны
+        {"A1", "A1"},
+        {"AA10", "AA10"},
+        {"SUM(A1)", "SUM(A1)"},
+        {"SUM(A1:B2,1)", "SUM(A1:B2,1)"},
+        {"(SUM(1))", "SUM(1)"},
+        {"1+(SUM(A1:A2))", "1+SUM(A1:A2)"},
+        {"AVERAGE(-1,+2)", "AVERAGE(-1,+2)"},
+        {"MAX(1,MIN(2,3))*COUNT(A1:A3)", "MAX(1,MIN(2,3))*COUNT(A1:A3)"},
+        // пробельные символы между лексемами
+        {" 1 + 2 ", "1+2"},
+        {"\t1\n*\r2", "1*2"},
+        {"SUM (1)", "SUM(1)"},
+    };
+    // некорректные выражения и ошибка, с которой их отвергает
+    // HandWrittenParser: лексема, на которой остановился разбор (пустая -
+    // конец выражения). ANTLR сообщает о тех же ошибках своими словами.
+    const std::pair<std::string, std::string> invalid[] = {
+        {"", "Error when parsing: "},
+        {"+", "Error when parsing: "},
+        {"1+", "Error when parsing: "},
+        {"(1+2", "Error when parsing: "},
+        {"1)", "Error when parsing: )"},
+        {"()", "Error when parsing: )"},
+        {"1 2", "Error when parsing: 2"},
+        {"1+*2", "Error when parsing: *"},
+        {"*1", "Error when parsing: *"},
+        {"1.2.3", "Error when parsing: .3"},
+        {"1e", "Error when lexing: token recognition error at: 'e'"},
+        {"5.", "Error when lexing: token recognition error at: '.'"},
+        {"sum(1)", "Error when lexing: token recognition error at: 's'"},
+        {"SUM(1;2)", "Error when lexing: token recognition error at: ';'"},
+        // NAME без скобки и CELL со скобкой
+        {"ABC", "Error when parsing: "},
+        {"SUM1(2)", "Error when parsing: ("},
+        {"A 1", "Error when parsing: 1"},
+        // диапазоны только в аргументах функций
+        {"A1:B2", "Error when parsing: :"},
+        {"SUM(A1:B2:C3)", "Error when parsing: :"},
+        {"SUM(A1:)", "Error when parsing: )"},
+        {"SUM()", "Error when parsing: )"},
+        {"SUM(1,)", "Error when parsing: )"},
+        {"SUM(,1)", "Error when parsing: ,"},
+        {"FOO(1)", "Unknown function: FOO"},
+        {"ZZZZ1", "Invalid position: ZZZZ1"},
+        {"A0", "Invalid position: A0"},
+    };
+
+    for (FormulaParserKind kind : {FormulaParserKind::Antlr, FormulaParserKind::HandWritten}) {
+        if (!IsFormulaParserAvailable(kind)) {
+            continue;
+        }
+        FormulaParserScope scope(kind);
+        for (const auto& [text, expression] : valid) {
+            AssertEqual(ParseFormula(text)->GetExpression(), expression, text);
+        }
+        for (const auto& [text, error] : invalid) {
+            bool thrown = false;
+            try {
+                ParseFormula(text);
+            } catch (const FormulaException&) {
+                thrown = true;
+            }
+            Assert(thrown, text);
+        }
+    }
+
+    for (const auto& [text, error] : invalid) {
+        std::string message;
+        try {
+            ParseFormulaAST(text, FormulaParserKind::HandWritten);
+        } catch (const std::exception& e) {
+            message = e.what();
+        }
+        AssertEqual(message, error, text);
+    }
+}
+
+// Ссылка на ячейку в аргументе функции и диапазон из одной этой ячейки
+// читаются одинаково, какой бы ни была ячейка
+void TestFunctionArguments() {
+    using Value = CellInterface::Value;
+    const FormulaError value_error(FormulaError::Category::Value);
+    const FormulaError div0(FormulaError::Category::Div0);
+    const std::string functions[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+    struct Case {
+        // текст B1, nullptr - ячейки нет
+        const char* text;
+        // значения функций в порядке functions
+        Value expected[5];
+    };
+    const Case cases[] = {
+        {nullptr, {0.0, div0, 0.0, 0.0, 0.0}},
+        {"", {0.0, div0, 0.0, 0.0, 0.0}},
+        {"abc", {value_error, value_error, value_error, value_error, 0.0}},
+        {"5", {5.0, 5.0, 5.0, 5.0, 1.0}},
+        {"=1/0", {div0, div0, div0, div0, 0.0}},
+    };
+
+    for (const Case& test : cases) {
+        auto sheet = CreateSheet();
+        if (test.text) {
+            sheet->SetCell("B1"_pos, test.text);
+        }
+        for (size_t i = 0; i < std::size(functions); ++i) {
+            const std::string hint = functions[i] + " of " + (test.text ? test.text : "no cell");
+            sheet->SetCell("A1"_pos, "=" + functions[i] + "(B1)");
+            sheet->SetCell("A2"_pos, "=" + functions[i] + "(B1:B1)");
+            AssertEqual(sheet->GetCell("A1"_pos)->GetValue(), test.expected[i], hint + ", cell");
+            AssertEqual(sheet->GetCell("A2"_pos)->GetValue(), test.expected[i], hint + ", range");
+        }
+    }
+}
+
+// Бросает ли f исключение Exception
+template <typename Exception, typename F>
+bool Throws(F f) {
+    try {
+        f();
+    } catch (const Exception&) {
+        return true;
+    }
+    return false;
+}
+
+// Пакет с ошибкой отбрасывается целиком и не меняет лист, в том числе
+// правки вложенных пакетов
+void TestBatchRollback() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    const auto assert_unchanged = [&sheet](const std::string& hint) {
+        AssertEqual(sheet.GetCell("A1"_pos)->GetText(), "1", hint);
+        AssertEqual(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0), hint);
+        Assert(sheet.GetCell("B1"_pos) == nullptr, hint);
+        AssertEqual(sheet.GetPrintableSize(), Size{2, 1}, hint);
+    };
+
+    // ошибка разбора во вложенном пакете
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "5");
+    sheet.BeginBatch();
+    sheet.SetCell("B1"_pos, "=1+");
+    sheet.CommitBatch();
+    assert_unchanged("inner commit");
+    ASSERT(Throws<FormulaException>([&sheet] {
+        sheet.CommitBatch();
+    }));
+    assert_unchanged("parse error");
+
+    // цикл, который замыкают только правки пакета вместе
+    sheet.BeginBatch();
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "=A2");
+    sheet.CommitBatch();
+    ASSERT(Throws<CircularDependencyException>([&sheet] {
+        sheet.CommitBatch();
+    }));
+    assert_unchanged("cycle");
+
+    // отброшенный пакет закрыт: правки снова применяются сразу, а цикл,
+    // снятый последней правкой той же ячейки, ошибкой не считается
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0));
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "=A2");
+    sheet.SetCell("A1"_pos, "7");
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // лишний CommitBatch() не ломает следующий пакет
+    ASSERT(Throws<std::logic_error>([&sheet] {
+        sheet.CommitBatch();
+    }));
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "7");
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+// Временный файл с заданным содержимым, удаляется вместе с объектом
+class TempFile {
+public:
+    TempFile(const std::string& name, const std::string& content)
+        : path_(std::filesystem::temp_directory_path() / name) {
+        std::ofstream(path_, std::ios::binary) << content;
+    }
+    ~TempFile() {
+        std::filesystem::remove(path_);
+    }
+
+    std::string GetPath() const {
+        return path_.string();
+    }
+
+private:
+    std::filesystem::path path_;
+};
+
+void TestLoadTexts() {
+    {
+        // пустые поля не меняют ячеек, \r перед \n отбрасывается
+        const TempFile file("spreadsheet_load_small.txt", "1\t\t=A1+1\r\n\n'=x\tabc\n=C1*2");
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "keep");
+        sheet.LoadTexts(file.GetPath());
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 3}));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "keep");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value("=x"));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "abc");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    }
+    {
+        const TempFile file("spreadsheet_load_separator.txt", "1;2\n=SUM(A1:B1)");
+        Sheet sheet;
+        sheet.LoadTexts(file.GetPath(), ';');
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    // файл от мегабайта разбирается кусками в пуле потоков
+    constexpr int ROWS = 12000;
+    constexpr int COLS = 12;
+    std::string content;
+    for (int row = 1; row <= ROWS; ++row) {
+        content += std::to_string(row);
+        for (int col = 1; col < COLS; ++col) {
+            content += "\t=A" + std::to_string(row) + "*" + std::to_string(col);
+        }
+        content += "\n";
+    }
+    ASSERT(content.size() >= (1 << 20));
+    {
+        const TempFile file("spreadsheet_load_large.txt", content);
+        Sheet sheet;
+        sheet.LoadTexts(file.GetPath());
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ROWS, COLS}));
+        const Position last{ROWS - 1, COLS - 1};
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(1.0 * ROWS * (COLS - 1)));
+    }
+
+    // ошибка в любом месте файла оставляет лист прежним
+    const std::pair<std::string, std::string> errors[] = {
+        {"bad_formula", content + "=1+\n"},
+        {"cycle", content + "=A" + std::to_string(ROWS + 2) + "\n=A" + std::to_string(ROWS + 1)},
+        {"position", "1\t" + std::string(Position::MAX_COLS, '\t') + "2\n"},
+    };
+    for (const auto& [name, text] : errors) {
+        const TempFile file("spreadsheet_load_" + name + ".txt", text);
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "old");
+        bool thrown = false;
+        try {
+            sheet.LoadTexts(file.GetPath());
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        Assert(thrown, name);
+        AssertEqual(sheet.GetPrintableSize(), Size{1, 1}, name);
+        AssertEqual(sheet.GetCell("A1"_pos)->GetText(), "old", name);
+    }
+    {
+        // внутри пакета загрузка встаёт в очередь после его правок
+        const TempFile file("spreadsheet_load_batch.txt", "=B1+1\t\t=A1");
+        Sheet sheet;
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "old");
+        sheet.SetCell("C1"_pos, "7");
+        sheet.LoadTexts(file.GetPath());
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        sheet.CommitBatch();
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+        // входы загруженных формул связаны с ними
+        sheet.SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // цикл с правкой того же пакета находит CommitBatch()
+        sheet.BeginBatch();
+        sheet.LoadTexts(file.GetPath());
+        sheet.SetCell("B1"_pos, "=C1");
+        ASSERT(Throws<CircularDependencyException>([&sheet] {
+            sheet.CommitBatch();
+        }));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "5");
+    }
+    Sheet sheet;
+    ASSERT(Throws<std::system_error>([&sheet] {
+        sheet.LoadTexts((std::filesystem::temp_directory_path() / "spreadsheet_missing.txt").string());
+    }));
+}
+
+// Пул формул загруженного листа узнаёт формы сохранённых формул и не
+// путает их с формами, у которых тот же текст с округлёнными числами
+void TestSnapshotShapes() {
+    const TempFile file("spreadsheet_shapes.snapshot", "");
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=1.23456789+A1");
+        sheet.SaveSnapshot(file.GetPath());
+    }
+    auto sheet = Sheet::LoadSnapshot(file.GetPath());
+    const size_t shape_count = sheet->GetFormulaPool().GetShapeCount();
+    sheet->SetCell("A2"_pos, "1");
+    sheet->SetCell("B2"_pos, "=1.23457+A2");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.23457 + 1));
+    ASSERT_EQUAL(sheet->GetFormulaPool().GetShapeCount(), shape_count + 1);
+
+    // та же форма в другой ячейке берётся из пула
+    sheet->SetCell("B3"_pos, "=1.23456789+A3");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(1.23456789));
+    ASSERT_EQUAL(sheet->GetFormulaPool().GetShapeCount(), shape_count + 1);
+}
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+}
+
+void WriteFile(const std::string& path, const std::string& content) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << content;
+}
+
+// Число в том виде, в каком его пишет снимок
+std::string Int32Bytes(std::int32_t value) {
+    std::string bytes(sizeof(value), '\0');
+    std::memcpy(bytes.data(), &value, sizeof(value));
+    return bytes;
+}
+
+std::string PrintTextsAndValues(const SheetInterface& sheet) {
+    std::ostringstream output;
+    output << sheet.GetPrintableSize() << '\n';
+    sheet.PrintTexts(output);
+    sheet.PrintValues(output);
+    return output.str();
+}
+
+void TestSnapshotRoundTrip() {
+    const TempFile file("spreadsheet_round_trip.snapshot", "");
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("B2"_pos, "=A1+1");
+    sheet.SetCell("B3"_pos, "=SUM(A1:B1)+B2+D10");
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=A3");
+    sheet.SetCell("C3"_pos, "");
+    // часть значений в кеше, часть ещё не вычислена
+    sheet.GetCell("B3"_pos)->GetValue();
+    sheet.GetCell("C1"_pos)->GetValue();
+    sheet.SaveSnapshot(file.GetPath());
+
+    auto loaded = Sheet::LoadSnapshot(file.GetPath());
+    ASSERT_EQUAL(PrintTextsAndValues(*loaded), PrintTextsAndValues(sheet));
+    ASSERT(loaded->GetCell("D10"_pos) != nullptr);
+    ASSERT_EQUAL(loaded->GetCell("D10"_pos)->GetText(), "");
+
+    // связи восстановлены: правки доходят до зависимых и находят циклы
+    for (Sheet* target : {&sheet, loaded.get()}) {
+        target->SetCell("A1"_pos, "2");
+        target->SetCell("D10"_pos, "10");
+        AssertEqual(target->GetCell("B3"_pos)->GetValue(), CellInterface::Value(18.0), "B3");
+        Assert(Throws<CircularDependencyException>([target] {
+                   target->SetCell("A1"_pos, "=B3");
+               }),
+               "cycle");
+    }
+    ASSERT_EQUAL(PrintTextsAndValues(*loaded), PrintTextsAndValues(sheet));
+
+    // повторное сохранение загруженного листа даёт тот же лист
+    const TempFile again("spreadsheet_round_trip_again.snapshot", "");
+    loaded->SaveSnapshot(again.GetPath());
+    ASSERT_EQUAL(PrintTextsAndValues(*Sheet::LoadSnapshot(again.GetPath())),
+                 PrintTextsAndValues(sheet));
+}
+
+// Повреждённый снимок отвергается целиком, даже если каждая запись в нём
+// по отдельности допустима
+void TestSnapshotValidation() {
+    const TempFile file("spreadsheet_corrupted.snapshot", "");
+    const auto rejected = [&file](const std::string& content) {
+        WriteFile(file.GetPath(), content);
+        return Throws<SnapshotError>([&file] {
+            Sheet::LoadSnapshot(file.GetPath());
+        });
+    };
+
+    // Запись ячейки начинается с позиции и места в порядке. Деревья формул
+    // тоже хранят позиции, но записи ячеек идут после них, поэтому ищется
+    // последнее вхождение.
+    const auto cell_record = [](Position pos, int order) {
+        return Int32Bytes(pos.row) + Int32Bytes(pos.col) + Int32Bytes(order);
+    };
+    const Position formula_pos{1000, 100};
+    const Position input_pos{1001, 101};
+    const std::string inputs[] = {
+        "=" + input_pos.ToString(),
+        "=SUM(" + Rect{input_pos, {1002, 102}}.ToString() + ")",
+    };
+    for (const std::string& formula : inputs) {
+        Sheet sheet;
+        sheet.SetCell(input_pos, "1");
+        sheet.SetCell(formula_pos, formula);
+        sheet.SaveSnapshot(file.GetPath());
+        std::string content = ReadFile(file.GetPath());
+        const int formula_order = sheet.FindCell(formula_pos)->GetOrder();
+        const int input_order = sheet.FindCell(input_pos)->GetOrder();
+        Assert(input_order < formula_order, formula);
+        Assert(!rejected(content), formula);
+
+        // вход встаёт в порядке на место формулы: A = B и B = A + 1
+        const std::string record = cell_record(input_pos, input_order);
+        const size_t record_at = content.rfind(record);
+        Assert(record_at != std::string::npos, formula);
+        content.replace(record_at, record.size(), cell_record(input_pos, formula_order));
+        Assert(rejected(content), formula);
+    }
+    // категория ошибки вне FormulaError::Category; значение - последнее
+    // поле единственной записи
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1/0");
+        sheet.GetCell("A1"_pos)->GetValue();
+        sheet.SaveSnapshot(file.GetPath());
+        std::string content = ReadFile(file.GetPath());
+        const std::string div0 = Int32Bytes(static_cast<std::int32_t>(FormulaError::Category::Div0));
+        ASSERT_EQUAL(content.substr(content.size() - div0.size()), div0);
+        ASSERT(!rejected(content));
+        for (std::int32_t category : {-1, 3}) {
+            content.replace(content.size() - div0.size(), div0.size(), Int32Bytes(category));
+            Assert(rejected(content), std::to_string(category));
+        }
+    }
+}
+
+// Значения области вычисляются без обхода остального листа и совпадают с
+// теми, что печатает PrintValues() всего листа
+void TestRangeValues() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("D2"_pos, "=Z100");
+    sheet.SetCell("E1"_pos, "=B1*10");
+    sheet.SetCell("A5"_pos, "=B1+E1");
+
+    std::ostringstream output;
+    sheet.PrintValues(output, Rect{"A1"_pos, "D3"_pos});
+    ASSERT_EQUAL(output.str(), "1\t2\ttext\t\n=escaped\t#DIV/0!\t\t0\n\t\t\t\n");
+    // ячейки вне области, от которых она не зависит, не вычислены
+    ASSERT(!sheet.FindCell("E1"_pos)->HasCachedValue());
+    ASSERT(!sheet.FindCell("A5"_pos)->HasCachedValue());
+
+    using Value = CellInterface::Value;
+    using Values = std::vector<std::vector<Value>>;
+    const Values expected = {
+        {2.0, std::string("text")},
+        {FormulaError(FormulaError::Category::Div0), std::string()},
+    };
+    ASSERT(sheet.GetValues(Rect{"B1"_pos, "C2"_pos}) == expected);
+    ASSERT(sheet.GetValues(Rect{"A5"_pos, "A5"_pos}) == Values{{Value(22.0)}});
+    ASSERT(sheet.FindCell("E1"_pos)->HasCachedValue());
+
+    // область на весь лист печатается так же, как весь лист
+    const Size size = sheet.GetPrintableSize();
+    std::ostringstream whole;
+    std::ostringstream range;
+    sheet.PrintValues(whole);
+    sheet.PrintValues(range, Rect{{0, 0}, {size.rows - 1, size.cols - 1}});
+    ASSERT_EQUAL(range.str(), whole.str());
+
+    ASSERT(Throws<InvalidPositionException>([&sheet] {
+        sheet.GetValues(Rect{"B2"_pos, "A1"_pos});
+    }));
+    ASSERT(Throws<InvalidPositionException>([&sheet] {
+        std::ostringstream output;
+        sheet.PrintValues(output, Rect{"A1"_pos, {Position::MAX_ROWS, 0}});
+    }));
+}
+
+// Счётчики каждого листа видят только его работу, сколько бы листов ни
+// читал поток попеременно
+void TestStatsPerSheet() {
+    constexpr int SHEETS = 40;
+    std::vector<std::unique_ptr<Sheet>> sheets;
+    for (int i = 0; i < SHEETS; ++i) {
+        sheets.push_back(std::make_unique<Sheet>());
+        sheets.back()->SetCell("A1"_pos, "=1+" + std::to_string(i));
+    }
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < SHEETS; ++i) {
+            for (int read = 0; read <= i % 3; ++read) {
+                sheets[i]->GetCell("A1"_pos)->GetValue();
+            }
+        }
+    }
+    for (int i = 0; i < SHEETS; ++i) {
+        const SheetStats stats = sheets[i]->GetStats();
+        const std::string hint = "sheet " + std::to_string(i);
+        AssertEqual(stats.cache_misses, 1u, hint);
+        AssertEqual(stats.cache_hits, 3u * (i % 3 + 1) - 1, hint);
+        AssertEqual(stats.parses, 1u, hint);
+    }
+}
+
+// Случайная правка ячейки небольшого листа: число, текст, очистка или
+// формула из ссылок, диапазонов и деления, которое может дать ошибку
+std::string RandomCellText(std::mt19937& random, int rows, int cols) {
+    const auto random_cell = [&] {
+        return Position{static_cast<int>(random() % rows), static_cast<int>(random() % cols)}
+            .ToString();
+    };
+    switch (random() % 6) {
+        case 0:
+            return std::to_string(random() % 5);
+        case 1:
+            return random() % 2 == 0 ? "text" : "";
+        case 2:
+            return "=SUM(" + random_cell() + ":" + random_cell() + ")";
+        case 3:
+            return "=" + random_cell() + "/" + random_cell();
+        default:
+            return "=" + random_cell() + "+" + random_cell() + "*" + std::to_string(random() % 3);
+    }
+}
+
+// Ленивый сброс кешей даёт те же значения, что и немедленный, при любом
+// порядке правок, чтений и пересчётов
+void TestInvalidationModes() {
+    constexpr int ROWS = 8;
+    constexpr int COLS = 6;
+    const Rect area{{0, 0}, {ROWS - 1, COLS - 1}};
+    const auto value_at = [](const Sheet& sheet, Position pos) {
+        const CellInterface* cell = sheet.GetCell(pos);
+        return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+    };
+    std::mt19937 random(42);
+    Sheet sheets[2];
+    Sheet* eager = &sheets[0];
+    Sheet* lazy = &sheets[1];
+    lazy->SetInvalidationMode(InvalidationMode::Lazy);
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos{static_cast<int>(random() % ROWS), static_cast<int>(random() % COLS)};
+        const std::string text = RandomCellText(random, ROWS, COLS);
+        const std::string hint = "step " + std::to_string(step) + ": " + pos.ToString() + " = " + text;
+        const bool eager_cycle = Throws<CircularDependencyException>([&] {
+            eager->SetCell(pos, text);
+        });
+        const bool lazy_cycle = Throws<CircularDependencyException>([&] {
+            lazy->SetCell(pos, text);
+        });
+        AssertEqual(lazy_cycle, eager_cycle, hint);
+
+        switch (random() % 3) {
+            case 0:
+                lazy->Recalculate();
+                break;
+            case 1:
+                AssertEqual(value_at(*lazy, pos), value_at(*eager, pos), hint);
+                break;
+            default:
+                break;
+        }
+        if (step % 10 == 0) {
+            Assert(lazy->GetValues(area) == eager->GetValues(area), hint);
+        }
+        if (step % 1000 == 999) {
+            // листы меняются режимами посреди правок
+            lazy->SetInvalidationMode(InvalidationMode::Eager);
+            eager->SetInvalidationMode(InvalidationMode::Lazy);
+            std::swap(lazy, eager);
+        }
+    }
+}
+
+// Раннее отсечение: правка или пересчёт, не изменившие значения, не
+// трогают зависимых, и счётчик cutoffs считает только такие случаи
+void TestEarlyCutoff() {
+    // ячейки-заглушки для ссылок формулы и пустые ячейки, оставшиеся
+    // пустыми, не считаются отсечением
+    for (InvalidationMode mode : {InvalidationMode::Eager, InvalidationMode::Lazy}) {
+        Sheet sheet;
+        sheet.SetInvalidationMode(mode);
+        sheet.SetCell("A1"_pos, "=B1+C1+D1");
+        sheet.ClearCell("E1"_pos);
+        sheet.SetCells({{"B1"_pos, ""}, {"F1"_pos, ""}});
+        ASSERT_EQUAL(sheet.GetStats().cutoffs, 0u);
+    }
+    for (InvalidationMode mode : {InvalidationMode::Eager, InvalidationMode::Lazy}) {
+        const std::string hint = mode == InvalidationMode::Eager ? "eager" : "lazy";
+        Sheet sheet;
+        sheet.SetInvalidationMode(mode);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.GetCell("B1"_pos)->GetValue();
+
+        // тот же номер другим текстом
+        SheetStats before = sheet.GetStats();
+        sheet.SetCell("A1"_pos, "1.0");
+        Assert(sheet.FindCell("B1"_pos)->HasCachedValue(), hint);
+        sheet.GetCell("B1"_pos)->GetValue();
+        SheetStats after = sheet.GetStats();
+        AssertEqual(after.cutoffs, before.cutoffs + 1, hint + ", edit");
+        AssertEqual(after.evaluations, before.evaluations, hint + ", edit");
+
+        // пакет в режиме Eager сбрасывает кеши зависимых любой своей ячейки,
+        // и отсечения нет
+        before = after;
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "01");
+        sheet.CommitBatch();
+        AssertEqual(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0), hint);
+        after = sheet.GetStats();
+        const bool eager = mode == InvalidationMode::Eager;
+        AssertEqual(after.cutoffs, before.cutoffs + (eager ? 0 : 1), hint + ", batch");
+        AssertEqual(after.evaluations, before.evaluations + (eager ? 1 : 0), hint + ", batch");
+    }
+
+    // формула, вычисленная заново с прежним значением, останавливает
+    // распространение правки
+    Sheet sheet;
+    sheet.SetInvalidationMode(InvalidationMode::Lazy);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.Recalculate();
+    const SheetStats before = sheet.GetStats();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    const SheetStats after = sheet.GetStats();
+    ASSERT_EQUAL(after.cutoffs, before.cutoffs + 1);
+    ASSERT_EQUAL(after.evaluations, before.evaluations + 1);
+}
+
+// Параллельный пересчёт вычисляет те же значения, что и последовательный,
+// и каждую ячейку один раз
+void TestParallelRecalculate() {
+    constexpr int ROWS = 300;
+    constexpr int COLS = 20;
+    const Rect area{{0, 0}, {ROWS - 1, COLS - 1}};
+    std::mt19937 random(7);
+    // формулы столбца ссылаются только на предыдущие столбцы, поэтому слоёв
+    // графа столько же, сколько столбцов, а ячейки слоя независимы
+    const auto random_text = [&random](Position pos) -> std::string {
+        if (pos.col == 0) {
+            return random() % 50 == 0 ? "text" : std::to_string(random() % 10);
+        }
+        const auto earlier = [&] {
+            return Position{static_cast<int>(random() % ROWS), static_cast<int>(random() % pos.col)}
+                .ToString();
+        };
+        switch (random() % 4) {
+            case 0: {
+                const Position corner{static_cast<int>(random() % ROWS), pos.col - 1};
+                const Rect range{{std::max(0, corner.row - 5), 0}, corner};
+                return "=SUM(" + range.ToString() + ")/10";
+            }
+            case 1:
+                return "=" + earlier() + "/" + earlier();
+            default:
+                return "=" + earlier() + "+" + earlier() + "*0.5";
+        }
+    };
+
+    Sheet sequential;
+    Sheet parallel;
+    for (int col = 0; col < COLS; ++col) {
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string text = random_text({row, col});
+            sequential.SetCell({row, col}, text);
+            parallel.SetCell({row, col}, text);
+        }
+    }
+    for (int round = 0; round < 5; ++round) {
+        const std::string hint = "round " + std::to_string(round);
+        const SheetStats sequential_before = sequential.GetStats();
+        const SheetStats parallel_before = parallel.GetStats();
+        sequential.Recalculate(RecalcPolicy::Sequential);
+        parallel.Recalculate(RecalcPolicy::Parallel);
+        AssertEqual(parallel.GetStats().evaluations - parallel_before.evaluations,
+                    sequential.GetStats().evaluations - sequential_before.evaluations, hint);
+        Assert(parallel.GetValues(area) == sequential.GetValues(area), hint);
+
+        // правки в начале графа сбрасывают кеши большей его части
+        for (int edit = 0; edit < 20; ++edit) {
+            const Position pos{static_cast<int>(random() % ROWS),
+                               static_cast<int>(random() % 3)};
+            const std::string text = random_text(pos);
+            sequential.SetCell(pos, text);
+            parallel.SetCell(pos, text);
+        }
+    }
+}
+
+// Номера топологического порядка, дошедшие до границ int, выдаются заново
+// перенумерацией листа. Чтобы не делать миллиарды правок, счётчики
+// снимка выставлены у самых границ.
+void TestOrderCompaction() {
+    const TempFile file("spreadsheet_orders.snapshot", "");
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 5; ++row) {
+            sheet.SetCell({row, 1}, "=A1+" + std::to_string(row));
+        }
+        sheet.SetCell("C1"_pos, "=SUM(D1:D10)");
+        sheet.SaveSnapshot(file.GetPath());
+    }
+    // заголовок: сигнатура, версия, порядок байт, первый и следующий номер
+    std::string content = ReadFile(file.GetPath());
+    const size_t first_order_at = 16;
+    content.replace(first_order_at, 4, Int32Bytes(std::numeric_limits<int>::min() + 2));
+    content.replace(first_order_at + 4, 4, Int32Bytes(std::numeric_limits<int>::max() - 3));
+    WriteFile(file.GetPath(), content);
+    auto sheet = Sheet::LoadSnapshot(file.GetPath());
+    ASSERT_EQUAL(sheet->GetLastOrder(), std::numeric_limits<int>::max() - 4);
+
+    // каждый пакет переносит в конец порядка A1 и пять зависимых
+    for (int value = 2; value < 10; ++value) {
+        sheet->SetCells({{"A1"_pos, std::to_string(value)}});
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(value + 4.0));
+    }
+    ASSERT(sheet->GetLastOrder() < 100);
+    // новые ячейки в диапазоне формулы встают в начало порядка
+    for (int row = 0; row < 10; ++row) {
+        sheet->SetCell({row, 3}, "1");
+    }
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // порядок после перенумерации по-прежнему находит циклы
+    ASSERT(Throws<CircularDependencyException>([&sheet] {
+        sheet->SetCell("A1"_pos, "=B3");
+    }));
+    ASSERT(Throws<CircularDependencyException>([&sheet] {
+        sheet->SetCell("D1"_pos, "=C1");
+    }));
+    sheet->SetCell("A1"_pos, "=D1");
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(5.0));
+}
+
+// PrintValues() без Recalculate() вычисляет сброшенные кеши и забывает
+// их, а следующие правки снова доходят до печати и пересчёта
+void TestPrintWithoutRecalculate() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    const auto print = [&sheet] {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        return output.str();
+    };
+    ASSERT_EQUAL(print(), "1\t2\t3\n");
+    ASSERT_EQUAL(print(), "1\t2\t3\n");
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(print(), "2\t4\t6\n");
+    sheet.SetCell("A1"_pos, "3");
+    sheet.Recalculate(RecalcPolicy::Parallel);
+    ASSERT_EQUAL(print(), "3\t6\t9\n");
+    sheet.SetCell("A1"_pos, "4");
+    sheet.SetInvalidationMode(InvalidationMode::Lazy);
+    ASSERT_EQUAL(print(), "4\t8\t12\n");
+    const std::uint64_t evaluations = sheet.GetStats().evaluations;
+    ASSERT_EQUAL(print(), "4\t8\t12\n");
+    ASSERT_EQUAL(sheet.GetStats().evaluations, evaluations);
+}
+
+// Ячейка number цепочки, идущей по столбцам сверху вниз
+Position ChainPosition(int number) {
+    return {number % Position::MAX_ROWS, number / Position::MAX_ROWS};
+}
+
+void TestDeepChain() {
+    constexpr int LENGTH = 1000000;
+    auto sheet = CreateSheet();
+    sheet->SetCell(ChainPosition(0), "1");
+    for (int i = 1; i < LENGTH; ++i) {
+        sheet->SetCell(ChainPosition(i), "=" + ChainPosition(i - 1).ToString() + "+1");
+    }
+    const Position tail = ChainPosition(LENGTH - 1);
+    ASSERT_EQUAL(sheet->GetCell(tail)->GetValue(), CellInterface::Value(LENGTH + 0.0));
+
+    sheet->SetCell(ChainPosition(0), "2");
+    ASSERT_EQUAL(sheet->GetCell(tail)->GetValue(), CellInterface::Value(LENGTH + 1.0));
+
+    bool cycle_found = false;
+    try {
+        sheet->SetCell(ChainPosition(0), "=" + tail.ToString());
+    } catch (const CircularDependencyException&) {
+        cycle_found = true;
+    }
+    ASSERT(cycle_found);
+    ASSERT_EQUAL(sheet->GetCell(ChainPosition(0))->GetText(), "2");
+}
+
+void TestLongExpression() {
+    constexpr int TERMS = 1000000;
+    std::string expression = "1";
+    for (int i = 1; i < TERMS; ++i) {
+        expression += i % 2 == 0 ? "+1" : "-A1*0";
+    }
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=" + expression);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(TERMS / 2 + 0.0));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=" + expression);
+}
+
 int main() {
     TestClearPrint();
+
+    TestRunner tr;
+    RUN_TEST(tr, TestParserCorpus);
+    RUN_TEST(tr, TestFunctionArguments);
+    RUN_TEST(tr, TestBatchRollback);
+    RUN_TEST(tr, TestOrderCompaction);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshotShapes);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestSnapshotValidation);
+    RUN_TEST(tr, TestRangeValues);
+    RUN_TEST(tr, TestPrintWithoutRecalculate);
+    RUN_TEST(tr, TestStatsPerSheet);
+    RUN_TEST(tr, TestInvalidationModes);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestParallelRecalculate);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestLongExpression);
 }
@@ -0,0 +1,122 @@
+#include "range_index.h"
+
+#include <cassert>
+
+template <typename F>
+void RangeIndex::ForEachNode(int first, int last, std::uint32_t leaves, F f) {
+    // снизу вверх, полуинтервал [lo, hi) листьев
+    std::uint32_t lo = leaves + first;
+    std::uint32_t hi = leaves + last + 1;
+    for (; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+            f(lo++);
+        }
+        if (hi & 1) {
+            f(--hi);
+        }
+    }
+}
+
+int RangeIndex::GetDepth(std::uint32_t node) {
+    int depth = 0;
+    for (; node > 1; node /= 2) {
+        ++depth;
+    }
+    return depth;
+}
+
+RangeIndex::ColumnTree& RangeIndex::GetColumnTree(std::uint32_t row_node) {
+    if (row_trees_[row_node] == 0) {
+        if (!free_trees_.empty()) {
+            row_trees_[row_node] = free_trees_.back();
+            free_trees_.pop_back();
+        } else {
+            row_trees_[row_node] = static_cast<std::uint32_t>(column_trees_.size());
+            column_trees_.emplace_back();
+        }
+    }
+    return column_trees_[row_trees_[row_node]];
+}
+
+RangeIndex::Handle RangeIndex::Insert(Rect range, Cell* cell) {
+    assert(range.IsValid());
+    if (row_trees_.empty()) {
+        row_trees_.assign(2 * ROW_LEAVES, 0);
+        // дерево 0 не используется: так 0 в row_trees_ означает "нет дерева"
+        column_trees_.emplace_back();
+    }
+    Handle handle;
+    if (!free_records_.empty()) {
+        handle = free_records_.back();
+        free_records_.pop_back();
+    } else {
+        handle = static_cast<Handle>(records_.size());
+        records_.emplace_back();
+    }
+    Record& record = records_[handle];
+    record.cell = cell;
+    ForEachNode(range.top_left.row, range.bottom_right.row, ROW_LEAVES, [&](std::uint32_t row_node) {
+        ColumnTree& columns = GetColumnTree(row_node);
+        ForEachNode(range.top_left.col, range.bottom_right.col, COL_LEAVES, [&](std::uint32_t col_node) {
+            std::vector<Entry>& entries = columns.lists[col_node];
+            if (entries.empty()) {
+                const int depth = GetDepth(col_node);
+                if (columns.depth_nodes[depth]++ == 0) {
+                    columns.depths |= 1u << depth;
+                }
+            }
+            record.pieces.push_back({row_node, col_node, static_cast<std::uint32_t>(entries.size())});
+            entries.push_back({cell, handle, static_cast<std::uint32_t>(record.pieces.size() - 1)});
+        });
+    });
+    ++size_;
+    return handle;
+}
+
+void RangeIndex::Erase(Handle handle) {
+    assert(handle < records_.size() && records_[handle].cell != nullptr);
+    Record& record = records_[handle];
+    for (const Piece& piece : record.pieces) {
+        const std::uint32_t tree = row_trees_[piece.row_node];
+        ColumnTree& columns = column_trees_[tree];
+        const auto it = columns.lists.find(piece.col_node);
+        assert(it != columns.lists.end());
+        std::vector<Entry>& entries = it->second;
+        // на место записи встаёт последняя в списке; другой записи той же
+        // формулы в этом списке нет, у каждой пары узлов один кусок
+        if (piece.slot + 1 != entries.size()) {
+            const Entry& moved = entries.back();
+            records_[moved.handle].pieces[moved.piece].slot = piece.slot;
+            entries[piece.slot] = moved;
+        }
+        entries.pop_back();
+        if (!entries.empty()) {
+            continue;
+        }
+        columns.lists.erase(it);
+        const int depth = GetDepth(piece.col_node);
+        if (--columns.depth_nodes[depth] == 0) {
+            columns.depths &= ~(1u << depth);
+        }
+        if (columns.lists.empty()) {
+            row_trees_[piece.row_node] = 0;
+            free_trees_.push_back(tree);
+        }
+    }
+    record.cell = nullptr;
+    record.pieces.clear();
+    free_records_.push_back(handle);
+    --size_;
+}
+
+bool RangeIndex::Covers(Position pos) const {
+    bool covered = false;
+    ForEachCovering(pos, [&covered](Cell*) {
+        covered = true;
+    });
+    return covered;
+}
+
+size_t RangeIndex::Size() const {
+    return size_;
+}
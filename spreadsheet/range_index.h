@@ -0,0 +1,133 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Диапазоны, на которые ссылаются формулы листа. По позиции ячейки находит
+// формулы, чьи диапазоны её накрывают. Диапазон - одна зависимость формулы:
+// для его ячеек не заводятся ни отдельные рёбра, ни ячейки-заглушки.
+//
+// Устроен как двумерное дерево отрезков: дерево по строкам листа, в узле
+// которого лежит дерево по столбцам. Диапазон раскладывается на
+// O(log MAX_ROWS) узлов по строкам и в каждом из них на O(log MAX_COLS)
+// узлов по столбцам, запись о нём хранится в каждой такой паре узлов.
+// Ячейка лежит в диапазоне, только если ровно одна из этих пар лежит на
+// путях от корней к её строке и столбцу, поэтому запрос смотрит только пары
+// на этих путях и находит лишь накрывающие её диапазоны: тысяча формул над
+// разными столбцами не замедляет запрос по одному из них. Дерево по
+// столбцам хранит только узлы с записями и помнит глубины, на которых они
+// есть, чтобы запрос не искал узлы на пустых глубинах. Память и время не
+// зависят от площади диапазонов.
+class RangeIndex {
+public:
+    // запись о диапазоне, по которой он удаляется
+    using Handle = std::uint32_t;
+
+    Handle Insert(Rect range, Cell* cell);
+    // Удаляет запись, возвращённую Insert(), за время, пропорциональное
+    // числу её узлов
+    void Erase(Handle handle);
+
+    // Накрывает ли pos хотя бы один диапазон
+    bool Covers(Position pos) const;
+
+    // Вызывает f(cell) для формул, чей диапазон накрывает pos. Формула с
+    // несколькими такими диапазонами встречается несколько раз.
+    template <typename F>
+    void ForEachCovering(Position pos, F f) const;
+
+    // число записей
+    size_t Size() const;
+
+private:
+    // число листьев деревьев, степени двойки
+    static constexpr std::uint32_t ROW_LEAVES = Position::MAX_ROWS;
+    static constexpr std::uint32_t COL_LEAVES = Position::MAX_COLS;
+    static_assert((ROW_LEAVES & (ROW_LEAVES - 1)) == 0);
+    static_assert((COL_LEAVES & (COL_LEAVES - 1)) == 0);
+    // глубины дерева по столбцам, от корня до листьев
+    static constexpr int COL_DEPTHS = 15;
+    static_assert(COL_LEAVES == 1u << (COL_DEPTHS - 1));
+
+    // запись в списке пары узлов
+    struct Entry {
+        Cell* cell;
+        Handle handle;
+        // номер куска в Record::pieces
+        std::uint32_t piece;
+    };
+
+    // дерево по столбцам в узле дерева по строкам
+    struct ColumnTree {
+        // бит d - на глубине d есть узлы с записями
+        std::uint16_t depths = 0;
+        // число узлов с записями на каждой глубине
+        std::array<std::uint32_t, COL_DEPTHS> depth_nodes{};
+        // записи узлов (нумерация кучи: корень 1, дети узла v - 2v и 2v+1)
+        std::unordered_map<std::uint32_t, std::vector<Entry>> lists;
+    };
+
+    // пара узлов, в которой лежит запись, и её место в списке пары
+    struct Piece {
+        std::uint32_t row_node;
+        std::uint32_t col_node;
+        std::uint32_t slot;
+    };
+
+    struct Record {
+        // nullptr у свободной записи
+        Cell* cell = nullptr;
+        std::vector<Piece> pieces;
+    };
+
+    // Номер дерева по столбцам для каждого узла дерева по строкам, 0 - у
+    // узла нет записей. Таблица заводится при первой вставке, чтобы лист без
+    // диапазонов не платил за индекс.
+    std::vector<std::uint32_t> row_trees_;
+    std::vector<ColumnTree> column_trees_;
+    std::vector<std::uint32_t> free_trees_;
+    std::vector<Record> records_;
+    std::vector<Handle> free_records_;
+    size_t size_ = 0;
+
+    // дерево по столбцам узла row_node, заводится при необходимости
+    ColumnTree& GetColumnTree(std::uint32_t row_node);
+    // вызывает f(node) для узлов дерева с leaves листьями, на которые
+    // раскладывается отрезок [first, last]
+    template <typename F>
+    static void ForEachNode(int first, int last, std::uint32_t leaves, F f);
+    static int GetDepth(std::uint32_t node);
+};
+
+template <typename F>
+void RangeIndex::ForEachCovering(Position pos, F f) const {
+    if (row_trees_.empty()) {
+        return;
+    }
+    const std::uint32_t col_leaf = COL_LEAVES + pos.col;
+    for (std::uint32_t row_node = ROW_LEAVES + pos.row; row_node > 0; row_node /= 2) {
+        const std::uint32_t tree = row_trees_[row_node];
+        if (tree == 0) {
+            continue;
+        }
+        const ColumnTree& columns = column_trees_[tree];
+        for (int depth = 0; depth < COL_DEPTHS; ++depth) {
+            if ((columns.depths >> depth & 1) == 0) {
+                continue;
+            }
+            const auto it = columns.lists.find(col_leaf >> (COL_DEPTHS - 1 - depth));
+            if (it == columns.lists.end()) {
+                continue;
+            }
+            for (const Entry& entry : it->second) {
+                f(entry.cell);
+            }
+        }
+    }
+}
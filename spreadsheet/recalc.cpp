@@ -0,0 +1,139 @@
+#include "recalc.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace {
+class ParallelExecution {
+public:
+    ParallelExecution(const RecalcPlan& plan, ThreadPool& pool)
+        : plan_(plan),
+          pool_(pool),
+          pending_(std::make_unique<std::atomic<std::uint32_t>[]>(plan.Size())) {
+        for (size_t i = 0; i < plan.Size(); ++i) {
+            pending_[i].store(plan.GetInputCount(i), std::memory_order_relaxed);
+        }
+    }
+
+    void Run() {
+        std::vector<std::uint32_t> roots;
+        for (std::uint32_t i = 0; i < plan_.Size(); ++i) {
+            if (plan_.GetInputCount(i) == 0) {
+                roots.push_back(i);
+            }
+        }
+
+        // независимые ячейки раздаём пачками, чтобы не ставить задачу на каждую
+        const size_t chunk = std::max<size_t>(1, roots.size() / (pool_.GetThreadCount() * 8));
+        for (size_t begin = 0; begin < roots.size(); begin += chunk) {
+            const size_t end = std::min(roots.size(), begin + chunk);
+            pool_.Submit([this, &roots, begin, end] {
+                for (size_t i = begin; i < end; ++i) {
+                    Process(roots[i]);
+                }
+            });
+        }
+        pool_.Wait();
+    }
+
+private:
+    static constexpr std::uint32_t NONE = UINT32_MAX;
+
+    const RecalcPlan& plan_;
+    ThreadPool& pool_;
+    // число ещё не вычисленных входов каждой ячейки плана
+    std::unique_ptr<std::atomic<std::uint32_t>[]> pending_;
+
+    void Process(std::uint32_t index) {
+        while (index != NONE) {
+            plan_.GetCell(index)->GetCachedValue();
+
+            // первую освободившуюся зависимую ячейку считаем сами,
+            // остальные отдаём пулу
+            std::uint32_t next = NONE;
+            plan_.ForEachDependent(index, [&](std::uint32_t dependent) {
+                if (pending_[dependent].fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                    return;
+                }
+                if (next == NONE) {
+                    next = dependent;
+                } else {
+                    pool_.Submit([this, dependent] { Process(dependent); });
+                }
+            });
+            index = next;
+        }
+    }
+};
+}  // namespace
+
+RecalcPlan::RecalcPlan(const FlatHashSet<Cell*>& dirty_cells) {
+    FlatHashMap<const Cell*, std::uint32_t> indexes;
+    indexes.Reserve(dirty_cells.GetSize());
+    for (Cell* cell : dirty_cells) {
+        // значение могло быть вычислено лениво уже после инвалидации
+        if (!cell->HasCachedValue()) {
+            indexes.Emplace(cell, static_cast<std::uint32_t>(cells_.size()));
+            cells_.push_back(cell);
+        }
+    }
+
+    input_counts_.assign(cells_.size(), 0);
+    dependents_offsets_.reserve(cells_.size() + 1);
+    dependents_offsets_.push_back(0);
+    for (Cell* cell : cells_) {
+        // повторы допустимы: ребро учитывается в счётчике столько же раз,
+        // сколько раз снимается
+        cell->ForEachDependent([&](Cell* dependent) {
+            if (const std::uint32_t* index = indexes.Find(dependent)) {
+                dependents_.push_back(*index);
+                ++input_counts_[*index];
+            }
+        });
+        dependents_offsets_.push_back(static_cast<std::uint32_t>(dependents_.size()));
+    }
+}
+
+size_t RecalcPlan::Size() const {
+    return cells_.size();
+}
+
+Cell* RecalcPlan::GetCell(size_t index) const {
+    return cells_[index];
+}
+
+std::uint32_t RecalcPlan::GetInputCount(size_t index) const {
+    return input_counts_[index];
+}
+
+std::vector<std::uint32_t> RecalcPlan::TopologicalOrder() const {
+    std::vector<std::uint32_t> pending = input_counts_;
+    std::vector<std::uint32_t> order;
+    order.reserve(cells_.size());
+    for (std::uint32_t i = 0; i < cells_.size(); ++i) {
+        if (pending[i] == 0) {
+            order.push_back(i);
+        }
+    }
+    // order служит и очередью: ячейка попадает в него, когда посчитаны все её входы
+    for (size_t head = 0; head < order.size(); ++head) {
+        ForEachDependent(order[head], [&](std::uint32_t dependent) {
+            if (--pending[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        });
+    }
+    return order;
+}
+
+void RecalcPlan::Execute() const {
+    for (std::uint32_t index : TopologicalOrder()) {
+        cells_[index]->GetCachedValue();
+    }
+}
+
+void RecalcPlan::Execute(ThreadPool& pool) const {
+    ParallelExecution(*this, pool).Run();
+}
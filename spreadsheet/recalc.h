@@ -0,0 +1,49 @@
+#pragma once
+
+#include "cell.h"
+#include "flat_hash.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <vector>
+
+// План пересчёта: подграф ячеек без закешированного значения. Ячейки плана
+// пронумерованы, для каждой хранится число её входов внутри плана и список
+// зависящих от неё ячеек плана (в сжатом виде, одним массивом на весь план).
+class RecalcPlan {
+public:
+    explicit RecalcPlan(const FlatHashSet<Cell*>& dirty_cells);
+
+    size_t Size() const;
+    Cell* GetCell(size_t index) const;
+
+    // число ячеек плана, от которых зависит ячейка index
+    std::uint32_t GetInputCount(size_t index) const;
+
+    // вызывает f(dependent_index) для ячеек плана, зависящих от ячейки index
+    template <typename F>
+    void ForEachDependent(size_t index, F f) const;
+
+    // Порядок, в котором каждая ячейка идёт после всех своих входов
+    std::vector<std::uint32_t> TopologicalOrder() const;
+
+    // Вычисляет ячейки плана в текущем потоке в топологическом порядке
+    void Execute() const;
+    // Вычисляет ячейки плана в пуле потоков: ячейка вычисляется, как только
+    // готовы все её входы. Результат совпадает с однопоточным.
+    void Execute(ThreadPool& pool) const;
+
+private:
+    std::vector<Cell*> cells_;
+    std::vector<std::uint32_t> input_counts_;
+    // зависимые ячейки ячейки i лежат в dependents_[offsets_[i], offsets_[i + 1])
+    std::vector<std::uint32_t> dependents_offsets_;
+    std::vector<std::uint32_t> dependents_;
+};
+
+template <typename F>
+void RecalcPlan::ForEachDependent(size_t index, F f) const {
+    for (std::uint32_t i = dependents_offsets_[index]; i < dependents_offsets_[index + 1]; ++i) {
+        f(dependents_[i]);
+    }
+}
@@ -1,9 +1,24 @@
 #include "sheet.h"
+#include "FormulaAST.h"
+#include "mapped_file.h"
+#include "recalc.h"
+#include "snapshot.h"
 
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <locale>
+#include <numeric>
 #include <optional>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
 
 using namespace std::literals;
 Sheet::Sheet(){
@@ -15,98 +30,659 @@ void Sheet::SetCell(Position pos, std::string text) {
     if(!pos.IsValid()){
         throw InvalidPositionException("invalid position");
     }
+    if(batch_depth_ > 0){
+        batch_.push_back({pos, std::move(text)});
+        return;
+    }
 
-    bool IsExists = cells_.count(pos);
-    if(!IsExists){ cells_[pos] = std::make_unique<Cell>(*this); }
+    Cell* cell = cells_.Find(pos);
+    bool IsExists = cell != nullptr;
+    bool IsCounted = IsExists && !cell->Empty();
+    if(!IsExists){ cell = cells_.Insert(pos, std::make_unique<Cell>(*this, pos)); }
 
-    Cell* cell = cells_.at(pos).get();
     cell->Set(text, pos);
 
-    if(!IsExists){
-        if(int(rows_count_.size()) < pos.row) { rows_count_.push_back(0);} 
-        ++rows_count_[pos.row];
-        printable_size_.rows = printable_size_.rows < pos.row + 1 ? pos.row +1 : printable_size_.rows;
-
-        if(int(cols_count_.size()) < pos.col) { cols_count_.push_back(0);} 
-        ++cols_count_[pos.col];
-        printable_size_.cols = printable_size_.cols < pos.col + 1 ? pos.col +1 : printable_size_.cols;
+    if(!IsCounted){
+        CountCell(pos);
     }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
-    if(IsValid(pos)){
-        return cells_.at(pos).get(); 
-    } else {
-        return nullptr;
-    }
+    TestPosition(pos);
+    return cells_.Find(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
     //в случае если ячейка была очищена должен возвращать nullptr,
     //поэтому если cell = EmptyImpl возвращает nullptr
-    if(IsValid(pos) && !cells_.at(pos)->Empty()){
-        return cells_.at(pos).get(); 
+    TestPosition(pos);
+    Cell* cell = cells_.Find(pos);
+    if(cell != nullptr && !cell->Empty()){
+        return cell;
     } else {
         return nullptr;
     }
 }
 
 void Sheet::ClearCell(Position pos) {
-    if(IsValid(pos)){
-        cells_.at(pos)->Clear(); 
-        --rows_count_[pos.row];
-        --cols_count_[pos.col];
+    TestPosition(pos);
+    if(batch_depth_ > 0){
+        batch_.push_back({pos, std::nullopt});
+        return;
+    }
+    Cell* cell = cells_.Find(pos);
+    if(cell != nullptr && !cell->Empty()){
+        cell->Clear(); 
+        UncountCell(pos);
     } 
 }
 
+void Sheet::BeginBatch(){
+    ++batch_depth_;
+}
+
+void Sheet::CommitBatch(){
+    if(batch_depth_ == 0){
+        throw std::logic_error("CommitBatch() without BeginBatch()");
+    }
+    if(--batch_depth_ > 0){
+        return;
+    }
+    auto batch = std::move(batch_);
+    batch_.clear();
+    ApplyEdits(std::move(batch));
+}
+
+void Sheet::ApplyEdits(std::vector<PendingEdit> batch){
+    // после устойчивой сортировки последняя правка ячейки идёт последней в
+    // своей группе
+    std::stable_sort(batch.begin(), batch.end(), [](const auto& lhs, const auto& rhs){
+        return lhs.pos < rhs.pos;
+    });
+    std::vector<Cell::BatchEdit> edits;
+    std::vector<Position> positions;
+    edits.reserve(batch.size());
+    positions.reserve(batch.size());
+    for(size_t i = 0; i < batch.size(); ++i){
+        if(i + 1 < batch.size() && batch[i + 1].pos == batch[i].pos){
+            continue;
+        }
+        PendingEdit& edit = batch[i];
+        Cell* cell = cells_.Find(edit.pos);
+        if(!edit.text){
+            if(cell != nullptr && !cell->Empty()){
+                edits.push_back({cell, std::nullopt, false});
+                positions.push_back(edit.pos);
+            }
+            continue;
+        }
+        const bool created = cell == nullptr;
+        if(created){
+            cell = cells_.Insert(edit.pos, std::make_unique<Cell>(*this, edit.pos));
+        }
+        edits.push_back({cell, std::move(edit.text), created, std::move(edit.formula)});
+        positions.push_back(edit.pos);
+    }
+
+    // печатная область пересчитывается по состоянию ячеек до пакета
+    std::vector<bool> counted;
+    counted.reserve(edits.size());
+    for(const Cell::BatchEdit& edit : edits){
+        counted.push_back(!edit.created && !edit.cell->Empty());
+    }
+    Cell::ApplyBatch(edits);
+
+    for(size_t i = 0; i < edits.size(); ++i){
+        const bool is_set = edits[i].text.has_value();
+        if(is_set && !counted[i]){
+            CountCell(positions[i]);
+        }else if(!is_set && counted[i]){
+            UncountCell(positions[i]);
+        }
+    }
+}
+
+namespace {
+// Делит текст на count кусков примерно равной длины, каждый кусок, кроме
+// последнего, заканчивается переводом строки
+std::vector<std::string_view> SplitLines(std::string_view text, size_t count){
+    std::vector<std::string_view> chunks;
+    const size_t step = text.size() / count + 1;
+    size_t begin = 0;
+    while(begin < text.size()){
+        size_t end = text.find('\n', std::min(begin + step, text.size()) - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+    return chunks;
+}
+
+// Вызывает f(index) для index из [0, count), в пуле, если задач больше одной
+template <typename F>
+void ForEachIndex(size_t count, ThreadPool* pool, F f){
+    if(count <= 1 || pool == nullptr){
+        for(size_t index = 0; index < count; ++index){
+            f(index);
+        }
+        return;
+    }
+    for(size_t index = 0; index < count; ++index){
+        pool->Submit([&f, index]{ f(index); });
+    }
+    pool->Wait();
+}
+}  // namespace
+
+void Sheet::LoadTexts(const std::string& path, char separator){
+    const MappedFile file(path);
+    const std::string_view text = file.GetData();
+
+    ThreadPool* pool = text.size() < MIN_PARALLEL_LOAD_SIZE ? nullptr : &GetThreadPool();
+    const std::vector<std::string_view> chunks
+        = SplitLines(text, pool == nullptr ? 1 : pool->GetThreadCount() * 4);
+
+    // номер первой строки листа в каждом куске
+    std::vector<int> first_rows(chunks.size() + 1, 0);
+    ForEachIndex(chunks.size(), pool, [&](size_t index){
+        const std::string_view chunk = chunks[index];
+        first_rows[index + 1] = static_cast<int>(std::count(chunk.begin(), chunk.end(), '\n'));
+    });
+    std::partial_sum(first_rows.begin(), first_rows.end(), first_rows.begin());
+
+    std::vector<std::vector<PendingEdit>> chunk_edits(chunks.size());
+    ForEachIndex(chunks.size(), pool, [&](size_t index){
+        const std::string_view chunk = chunks[index];
+        std::vector<PendingEdit>& edits = chunk_edits[index];
+        int row = first_rows[index];
+        for(size_t line_begin = 0; line_begin < chunk.size(); ++row){
+            size_t line_end = chunk.find('\n', line_begin);
+            line_end = line_end == std::string_view::npos ? chunk.size() : line_end;
+            std::string_view line = chunk.substr(line_begin, line_end - line_begin);
+            line_begin = line_end + 1;
+            if(!line.empty() && line.back() == '\r'){
+                line.remove_suffix(1);
+            }
+
+            for(size_t field_begin = 0, col = 0; field_begin <= line.size(); ++col){
+                size_t field_end = line.find(separator, field_begin);
+                field_end = field_end == std::string_view::npos ? line.size() : field_end;
+                const std::string_view field = line.substr(field_begin, field_end - field_begin);
+                field_begin = field_end + 1;
+                if(field.empty()){
+                    continue;
+                }
+
+                const Position pos{row, static_cast<int>(col)};
+                TestPosition(pos);
+                if(field.size() > 1 && field[0] == FORMULA_SIGN){
+                    edits.push_back({pos, std::string{},
+                                     ParseCellFormula(field.substr(1), pos)});
+                }else{
+                    edits.push_back({pos, std::string(field)});
+                }
+            }
+        }
+    });
+
+    size_t total = 0;
+    for(const auto& edits : chunk_edits){
+        total += edits.size();
+    }
+    // в открытом пакете загруженные правки встают после уже запомненных и
+    // применяются вместе с ними
+    std::vector<PendingEdit> edits;
+    std::vector<PendingEdit>& target = batch_depth_ > 0 ? batch_ : edits;
+    target.reserve(target.size() + total);
+    for(auto& chunk : chunk_edits){
+        std::move(chunk.begin(), chunk.end(), std::back_inserter(target));
+    }
+    if(batch_depth_ == 0){
+        ApplyEdits(std::move(edits));
+    }
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells){
+    for(const auto& [pos, text] : cells){
+        TestPosition(pos);
+    }
+    BeginBatch();
+    for(auto& [pos, text] : cells){
+        batch_.push_back({pos, std::move(text)});
+    }
+    CommitBatch();
+}
+
+void Sheet::ClearRange(Rect range){
+    if(!range.IsValid()){
+        throw InvalidPositionException("Invalid range"s);
+    }
+    BeginBatch();
+    cells_.ForEachInRect(range, [this](Position pos, const Cell&){
+        batch_.push_back({pos, std::nullopt});
+    });
+    CommitBatch();
+}
+
+namespace {
+// Снимок: заголовок, таблица общих деревьев формул и записи ячеек в порядке
+// обхода листа. Ячейка-формула ссылается на дерево по номеру и хранит свой
+// сдвиг относительно него, так что каждая форма записана один раз.
+constexpr std::string_view SNAPSHOT_MAGIC = "SHEETSNP";
+constexpr std::uint32_t SNAPSHOT_VERSION = 3;
+// записывается в порядке байт машины, на которой снимок сохранён
+constexpr std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+enum class SnapshotContent : std::uint8_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+enum class SnapshotValue : std::uint8_t {
+    None,
+    Number,
+    Text,
+    Error,
+};
+
+void WriteSnapshotValue(SnapshotWriter& out, const Cell& cell){
+    // значение текста восстанавливается по самому тексту
+    if(cell.GetFormula() == nullptr || !cell.HasCachedValue()){
+        out.Write(SnapshotValue::None);
+        return;
+    }
+    const CellInterface::Value& value = cell.GetCachedValue();
+    if(const double* number = std::get_if<double>(&value)){
+        out.Write(SnapshotValue::Number);
+        out.Write(*number);
+    }else if(const std::string* text = std::get_if<std::string>(&value)){
+        out.Write(SnapshotValue::Text);
+        out.WriteString(*text);
+    }else{
+        out.Write(SnapshotValue::Error);
+        out.Write(std::get<FormulaError>(value).GetCategory());
+    }
+}
+
+std::optional<CellInterface::Value> ReadSnapshotValue(SnapshotReader& in){
+    switch(in.Read<SnapshotValue>()){
+        case SnapshotValue::None:
+            return std::nullopt;
+        case SnapshotValue::Number:
+            return in.Read<double>();
+        case SnapshotValue::Text:
+            return std::string(in.ReadString());
+        case SnapshotValue::Error: {
+            const auto category = in.Read<FormulaError::Category>();
+            if(category < FormulaError::Category::Ref || category > FormulaError::Category::Div0){
+                break;
+            }
+            return FormulaError(category);
+        }
+    }
+    throw SnapshotError("malformed cell value");
+}
+
+Position ReadSnapshotPosition(SnapshotReader& in){
+    Position pos;
+    pos.row = in.Read<std::int32_t>();
+    pos.col = in.Read<std::int32_t>();
+    return pos;
+}
+}  // namespace
+
+void Sheet::SaveSnapshot(const std::string& path) const{
+    SnapshotWriter shapes;
+    FlatHashMap<const FormulaAST*, std::uint32_t> shape_ids;
+    const auto pool_shapes = formula_pool_.GetShapes();
+    SnapshotWriter cells;
+    cells_.ForEach([&](Position pos, const Cell& cell){
+        cells.Write<std::int32_t>(pos.row);
+        cells.Write<std::int32_t>(pos.col);
+        cells.Write<std::int32_t>(cell.GetOrder());
+        cells.Write<std::uint8_t>(cell.Empty());
+        if(const FormulaInterface* formula = cell.GetFormula()){
+            const SharedFormula shared = GetSharedFormula(*formula);
+            const auto [id, inserted] = shape_ids.Emplace(
+                shared.ast.get(), static_cast<std::uint32_t>(shape_ids.GetSize()));
+            if(inserted){
+                // форма нужна, чтобы после загрузки пул узнавал эти деревья;
+                // дерева, которого нет в пуле, пул и не узнает
+                const Position anchor{pos.row - shared.shift.row, pos.col - shared.shift.col};
+                const auto shape = pool_shapes.find(shared.ast.get());
+                shapes.WriteString(shape == pool_shapes.end() ? ""s : shape->second);
+                shapes.Write<std::int32_t>(anchor.row);
+                shapes.Write<std::int32_t>(anchor.col);
+                shared.ast->Save(shapes);
+            }
+            cells.Write(SnapshotContent::Formula);
+            cells.Write(*id);
+            cells.Write<std::int32_t>(shared.shift.row);
+            cells.Write<std::int32_t>(shared.shift.col);
+        }else if(std::string text = cell.GetText(); !text.empty()){
+            cells.Write(SnapshotContent::Text);
+            cells.WriteString(text);
+        }else{
+            cells.Write(SnapshotContent::Empty);
+        }
+        WriteSnapshotValue(cells, cell);
+    });
+
+    SnapshotWriter header;
+    for(char c : SNAPSHOT_MAGIC){
+        header.Write(c);
+    }
+    header.Write(SNAPSHOT_VERSION);
+    header.Write(SNAPSHOT_BYTE_ORDER);
+    header.Write<std::int32_t>(first_order_);
+    header.Write<std::int32_t>(next_order_);
+    header.Write<std::uint64_t>(shape_ids.GetSize());
+    header.Write<std::uint64_t>(cells_.GetCellCount());
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for(const SnapshotWriter* part : {&header, &shapes, &cells}){
+        out.write(part->GetData().data(), static_cast<std::streamsize>(part->GetData().size()));
+    }
+    out.close();
+    if(!out){
+        throw SnapshotError("cannot write snapshot "s + path);
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path){
+    const MappedFile file(path);
+    SnapshotReader in(file.GetData());
+    if(file.GetData().size() < SNAPSHOT_MAGIC.size()
+       || in.ReadBytes(SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC){
+        throw SnapshotError(path + " is not a sheet snapshot"s);
+    }
+    if(in.Read<std::uint32_t>() != SNAPSHOT_VERSION){
+        throw SnapshotError("unsupported snapshot version"s);
+    }
+    if(in.Read<std::uint32_t>() != SNAPSHOT_BYTE_ORDER){
+        throw SnapshotError("snapshot has a different byte order"s);
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    const int first_order = in.Read<std::int32_t>();
+    const int next_order = in.Read<std::int32_t>();
+
+    std::vector<std::shared_ptr<const FormulaAST>> shapes(in.ReadCount(12));
+    std::vector<std::pair<Position, Cell*>> cells(in.ReadCount(15));
+    std::vector<Position> anchors(shapes.size());
+    for(size_t i = 0; i < shapes.size(); ++i){
+        std::string shape(in.ReadString());
+        anchors[i] = ReadSnapshotPosition(in);
+        shapes[i] = std::make_shared<const FormulaAST>(FormulaAST::Load(in));
+        if(!shape.empty()){
+            sheet->formula_pool_.Adopt(std::move(shape), shapes[i], anchors[i]);
+        }
+    }
+
+    const auto malformed = [](){
+        return SnapshotError("malformed cell record"s);
+    };
+    for(auto& [pos, cell] : cells){
+        pos = ReadSnapshotPosition(in);
+        const int order = in.Read<std::int32_t>();
+        const bool empty = in.Read<std::uint8_t>() != 0;
+        if(!pos.IsValid() || sheet->cells_.Find(pos) != nullptr
+           || order < first_order || order >= next_order){
+            throw malformed();
+        }
+
+        std::unique_ptr<FormulaInterface> formula;
+        std::string text;
+        switch(in.Read<SnapshotContent>()){
+            case SnapshotContent::Empty:
+                break;
+            case SnapshotContent::Text:
+                text = in.ReadString();
+                break;
+            case SnapshotContent::Formula: {
+                const auto id = in.Read<std::uint32_t>();
+                if(id >= shapes.size()){
+                    throw malformed();
+                }
+                const Position shift = ReadSnapshotPosition(in);
+                formula = MakeFormula({shapes[id], shift});
+                break;
+            }
+            default:
+                throw malformed();
+        }
+        std::optional<CellInterface::Value> value = ReadSnapshotValue(in);
+
+        cell = sheet->cells_.Insert(pos, std::make_unique<Cell>(*sheet, pos));
+        cell->Restore(std::move(formula), std::move(text), order, std::move(value), empty);
+        // ссылки сдвинутой формулы должны остаться на листе
+        for(Position input : cell->GetReferencedCells()){
+            if(!input.IsValid()){
+                throw malformed();
+            }
+        }
+        for(Rect range : cell->GetReferencedRanges()){
+            if(!range.IsValid()){
+                throw malformed();
+            }
+        }
+    }
+    if(!in.AtEnd()){
+        throw SnapshotError("unexpected data after the last cell"s);
+    }
+
+    // Входы формулы должны стоять в порядке раньше неё: на этом держится
+    // пересчёт по порядку, и так в графе не может оказаться цикла
+    for(auto [pos, cell] : cells){
+        const int order = cell->GetOrder();
+        for(Position input_pos : cell->GetReferencedCells()){
+            const Cell* input = sheet->FindCell(input_pos);
+            if(input != nullptr && input->GetOrder() >= order){
+                throw malformed();
+            }
+        }
+        for(Rect range : cell->GetReferencedRanges()){
+            sheet->ForEachCellInRect(range, [&](Position, const Cell& input){
+                if(input.GetOrder() >= order){
+                    throw malformed();
+                }
+            });
+        }
+    }
+
+    sheet->first_order_ = first_order;
+    sheet->next_order_ = next_order;
+    for(auto [pos, cell] : cells){
+        cell->LinkRestored();
+        if(!cell->Empty()){
+            sheet->CountCell(pos);
+        }
+        if(!cell->HasCachedValue()){
+            sheet->MarkDirty(cell);
+        }
+    }
+    return sheet;
+}
+
+ThreadPool& Sheet::GetThreadPool() const{
+    // создаётся при первом использовании
+    if(!thread_pool_){
+        thread_pool_ = std::make_unique<ThreadPool>(std::thread::hardware_concurrency());
+    }
+    return *thread_pool_;
+}
+
+void Sheet::CountCell(Position pos){
+    if(int(rows_count_.size()) < pos.row) { rows_count_.push_back(0);} 
+    ++rows_count_[pos.row];
+    printable_size_.rows = printable_size_.rows < pos.row + 1 ? pos.row +1 : printable_size_.rows;
+
+    if(int(cols_count_.size()) < pos.col) { cols_count_.push_back(0);} 
+    ++cols_count_[pos.col];
+    printable_size_.cols = printable_size_.cols < pos.col + 1 ? pos.col +1 : printable_size_.cols;
+}
+
+void Sheet::UncountCell(Position pos){
+    --rows_count_[pos.row];
+    --cols_count_[pos.col];
+}
+
 Size Sheet::GetPrintableSize() const {
     RefreshPrintableSize();
 
     return printable_size_;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    Size printable_size = GetPrintableSize();
-        for (int row = 0; row < printable_size.rows; ++row) {
+namespace {
+// Дописывает значения ячеек в буфер так, как их вывел бы в output
+// operator<<. Если у потока настройки по умолчанию, числа форматируются
+// std::to_chars: это тот же "%g" с точностью потока, но без потока и
+// локали. Иначе каждое значение выводится через поток с настройками output.
+class ValueFormatter {
+public:
+    explicit ValueFormatter(const std::ostream& output)
+        : output_(output),
+          precision_(static_cast<int>(output.precision())),
+          use_stream_((output.flags() & (std::ios::floatfield | std::ios::showpoint
+                                         | std::ios::showpos | std::ios::uppercase)) != 0
+                      || output.width() != 0 || output.precision() > MAX_PRECISION
+                      || output.getloc() != std::locale::classic()) {}
 
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (col > 0) {
-                output << "\t";
-            }
-            const auto& it = cells_.find({ row, col });
-            if (it != cells_.end() && it->second != nullptr && !it->second->GetText().empty()) {
-                std::visit([&](const auto value) {output << value; }, it->second->GetValue());
+    void Append(const CellInterface::Value& value, std::string& buffer) const {
+        if(use_stream_){
+            std::ostringstream stream;
+            stream.copyfmt(output_);
+            std::visit([&stream](const auto& v){ stream << v; }, value);
+            buffer += stream.str();
+        }else if(const double* number = std::get_if<double>(&value)){
+            char chars[32];
+            const auto result = std::to_chars(chars, chars + sizeof(chars), *number,
+                                              std::chars_format::general, precision_);
+            buffer.append(chars, result.ptr);
+        }else if(const std::string* text = std::get_if<std::string>(&value)){
+            buffer += *text;
+        }else{
+            buffer += std::get<FormulaError>(value).ToString();
+        }
+    }
+
+private:
+    // при большей точности число может не поместиться в буфер Append()
+    static constexpr std::streamsize MAX_PRECISION = 17;
+
+    const std::ostream& output_;
+    int precision_;
+    bool use_stream_;
+};
+}  // namespace
+
+template <typename Format>
+void Sheet::PrintCells(std::ostream& output, Format format) const {
+    const Size printable_size = GetPrintableSize();
+    // Строки делятся на куски примерно по PRINT_CHUNK_CELLS ячеек. Каждый
+    // кусок форматируется в свой буфер, на большом листе - в пуле потоков,
+    // затем буферы выводятся в поток по порядку. Буферы переиспользуются,
+    // поэтому вывод не держит в памяти весь текст листа.
+    const size_t cell_count = std::max<size_t>(cells_.GetCellCount(), 1);
+    const int chunk_rows = static_cast<int>(std::max<size_t>(
+        1, PRINT_CHUNK_CELLS * printable_size.rows / cell_count));
+    ThreadPool* pool = cells_.GetCellCount() < MIN_PARALLEL_PRINT_SIZE ? nullptr
+                                                                       : &GetThreadPool();
+    std::vector<std::string> buffers(pool == nullptr ? 1 : pool->GetThreadCount() * 2);
+
+    const int round_rows = chunk_rows * static_cast<int>(buffers.size());
+    for(int round_begin = 0; round_begin < printable_size.rows; round_begin += round_rows){
+        ForEachIndex(buffers.size(), pool, [&](size_t index){
+            std::string& buffer = buffers[index];
+            buffer.clear();
+            const int row_begin = round_begin + static_cast<int>(index) * chunk_rows;
+            const int row_end = std::min(row_begin + chunk_rows, printable_size.rows);
+            for(int row = row_begin; row < row_end; ++row){
+                // столбцы, для которых уже выведен разделитель
+                int opened_cols = 0;
+                const auto open_cols = [&](int count){
+                    if(count > opened_cols){
+                        buffer.append(count - std::max(opened_cols, 1), '\t');
+                        opened_cols = count;
+                    }
+                };
+                cells_.ForEachInRow(row, [&](int col, const Cell& cell){
+                    if(col >= printable_size.cols || !cell.HasText()){
+                        return;
+                    }
+                    open_cols(col + 1);
+                    format(cell, buffer);
+                });
+                open_cols(printable_size.cols);
+                buffer += '\n';
             }
+        });
+        for(const std::string& buffer : buffers){
+            output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
         }
-        output << "\n";
     }
 }
+
+void Sheet::PrintValues(std::ostream& output) const {
+    // формулы вычисляются заранее, форматирование только читает кеш
+    EvaluateDirtyCells();
+    const ValueFormatter formatter(output);
+    PrintCells(output, [&formatter](const Cell& cell, std::string& buffer) {
+        formatter.Append(cell.GetCachedValue(), buffer);
+    });
+}
+
 void Sheet::PrintTexts(std::ostream& output) const {
-    Size printable_size = GetPrintableSize();
-    for (int row = 0; row < printable_size.rows; ++row) {
+    PrintCells(output, [](const Cell& cell, std::string& buffer) {
+        buffer += cell.GetText();
+    });
+}
 
-        for (int col = 0; col < printable_size.cols; ++col) {
-            if (col > 0) {
-                output << "\t";
+void Sheet::PrintValues(std::ostream& output, Rect range) const {
+    EvaluateRange(range);
+    const ValueFormatter formatter(output);
+    std::string buffer;
+    for(int row = range.top_left.row; row <= range.bottom_right.row; ++row){
+        for(int col = range.top_left.col; col <= range.bottom_right.col; ++col){
+            if(col > range.top_left.col){
+                buffer += '\t';
             }
-            const auto& it = cells_.find({ row, col });
-            if (it != cells_.end() && it->second != nullptr && !it->second->GetText().empty()) {
-                output << it->second->GetText();
+            const Cell* cell = cells_.Find({row, col});
+            if(cell != nullptr && cell->HasText()){
+                formatter.Append(cell->GetCachedValue(), buffer);
             }
         }
-        output << "\n";
+        buffer += '\n';
     }
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+std::vector<std::vector<CellInterface::Value>> Sheet::GetValues(Rect range) const {
+    EvaluateRange(range);
+    std::vector<std::vector<CellInterface::Value>> values;
+    values.reserve(range.bottom_right.row - range.top_left.row + 1);
+    for(int row = range.top_left.row; row <= range.bottom_right.row; ++row){
+        std::vector<CellInterface::Value>& row_values = values.emplace_back();
+        row_values.reserve(range.bottom_right.col - range.top_left.col + 1);
+        for(int col = range.top_left.col; col <= range.bottom_right.col; ++col){
+            const Cell* cell = cells_.Find({row, col});
+            row_values.push_back(cell != nullptr ? cell->GetCachedValue()
+                                                 : CellInterface::Value(std::string()));
+        }
+    }
+    return values;
 }
 
 bool Sheet::IsValid(Position pos) const {
     TestPosition(pos);
-    return cells_.count(pos);
+    return cells_.Find(pos) != nullptr;
 }
 
 void Sheet::RefreshPrintableSize() const {
-    while(rows_count_[printable_size_.rows - 1] == 0  && printable_size_.rows != 0){
+    while(printable_size_.rows != 0 && rows_count_[printable_size_.rows - 1] == 0){
         --printable_size_.rows;
     }
-    while(cols_count_[printable_size_.cols - 1] == 0 && printable_size_.cols != 0){
+    while(printable_size_.cols != 0 && cols_count_[printable_size_.cols - 1] == 0){
         --printable_size_.cols;
     }
 }
@@ -121,7 +697,253 @@ Cell* Sheet::GetOrCreateCell(Position pos){
     if(!IsValid(pos)){
         SetCell(pos, "");
     }
-    return cells_.at(pos).get();
+    return cells_.Find(pos);
+}
+
+const Cell* Sheet::FindCell(Position pos) const{
+    return cells_.Find(pos);
+}
+
+Cell* Sheet::FindCell(Position pos){
+    return cells_.Find(pos);
+}
+
+void Sheet::Recalculate(RecalcPolicy policy){
+    // на маленьких планах синхронизация потоков дороже самих вычислений, а
+    // при ленивом сбросе проверка кеша пишет в ячейки-входы
+    if(invalidation_mode_ == InvalidationMode::Lazy){
+        PropagateChanges();
+        return;
+    }
+    if(policy == RecalcPolicy::Sequential || dirty_cells_.GetSize() < MIN_PARALLEL_PLAN_SIZE){
+        EvaluateDirtyCells();
+        return;
+    }
+
+    RecalcPlan plan(dirty_cells_);
+    dirty_cells_.Clear();
+
+    plan.Execute(GetThreadPool());
+}
+
+void Sheet::EvaluateDirtyCells() const{
+    if(invalidation_mode_ == InvalidationMode::Lazy){
+        PropagateChanges();
+        return;
+    }
+    // Порядок ячеек и так топологический, поэтому рёбра плана не нужны.
+    // Их число растёт с площадью диапазонов, а число ячеек - нет.
+    std::vector<const Cell*> cells;
+    for(const Cell* cell : dirty_cells_){
+        if(!cell->HasCachedValue()){
+            cells.push_back(cell);
+        }
+    }
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->GetOrder() < rhs->GetOrder();
+    });
+    for(const Cell* cell : cells){
+        cell->GetCachedValue();
+    }
+    dirty_cells_.Clear();
+}
+
+void Sheet::EvaluateRange(Rect range) const{
+    if(!range.IsValid()){
+        throw InvalidPositionException("Invalid range"s);
+    }
+    // невычисленные ячейки области и, по ссылкам и диапазонам, их входы;
+    // вычисленная ячейка уже не нуждается в своих входах
+    std::vector<const Cell*> cells;
+    FlatHashSet<const Cell*> visited;
+    cells_.ForEachInRect(range, [&](Position, const Cell& cell){
+        if(!cell.HasCachedValue()){
+            visited.Insert(&cell);
+            cells.push_back(&cell);
+        }
+    });
+    for(size_t i = 0; i < cells.size(); ++i){
+        cells[i]->ForEachInput([&](const Cell* input){
+            if(!input->HasCachedValue() && visited.Insert(input)){
+                cells.push_back(input);
+            }
+        });
+    }
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->GetOrder() < rhs->GetOrder();
+    });
+    for(const Cell* cell : cells){
+        cell->GetCachedValue();
+    }
+}
+
+void Sheet::PropagateChanges() const{
+    // Ячейка проверяется после всех своих входов, поэтому её вход, который
+    // ещё изменится, уже обработан. Изменилась ячейка, если её версия новее
+    // прошлого распространения; иначе её зависимые дальше не смотрятся.
+    const std::uint64_t since = propagated_revision_;
+    // в очереди вместе с ячейкой лежит её номер в порядке: сравнения не
+    // обращаются к самим ячейкам, разбросанным по памяти
+    using Entry = std::pair<int, const Cell*>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    // место под все изменённые ячейки берётся заранее: ячейки идут в
+    // порядке слотов другой таблицы, и растущая таблица собрала бы из них
+    // длинные цепочки проб
+    FlatHashSet<const Cell*> queued;
+    queued.Reserve(changed_cells_.GetSize());
+    for(const Cell* cell : changed_cells_){
+        queued.Insert(cell);
+        queue.push({cell->GetOrder(), cell});
+    }
+    changed_cells_.Clear();
+    while(!queue.empty()){
+        const Cell* cell = queue.top().second;
+        queue.pop();
+        cell->GetCachedValue();
+        if(cell->GetChangedAt() > since){
+            cell->ForEachDependent([&](const Cell* dependent){
+                if(queued.Insert(dependent)){
+                    queue.push({dependent->GetOrder(), dependent});
+                }
+            });
+        }
+    }
+    propagated_revision_ = revision_;
+}
+
+void Sheet::MarkDirty(Cell* cell){
+    dirty_cells_.Insert(cell);
+}
+
+void Sheet::MarkChanged(const Cell* cell){
+    changed_cells_.Insert(cell);
+}
+
+void Sheet::SetInvalidationMode(InvalidationMode mode){
+    if(mode == invalidation_mode_){
+        return;
+    }
+    cells_.ForEach([mode](Position, Cell& cell){
+        cell.AdoptInvalidationMode(mode);
+    });
+    if(mode == InvalidationMode::Lazy){
+        // формулы без кеша вычислятся при чтении или распространении правок
+        changed_cells_.Reserve(dirty_cells_.GetSize());
+        for(const Cell* cell : dirty_cells_){
+            changed_cells_.Insert(cell);
+        }
+        dirty_cells_.Clear();
+    }else{
+        changed_cells_.Clear();
+    }
+    invalidation_mode_ = mode;
+}
+
+InvalidationMode Sheet::GetInvalidationMode() const{
+    return invalidation_mode_;
+}
+
+std::uint64_t Sheet::GetRevision() const{
+    return revision_;
+}
+
+std::uint64_t Sheet::AdvanceRevision(){
+    return ++revision_;
+}
+
+std::uint64_t Sheet::GetPropagatedRevision() const{
+    return propagated_revision_;
+}
+
+int Sheet::AllocateOrder(Position pos){
+    if(range_index_.Covers(pos)){
+        if(first_order_ == std::numeric_limits<int>::min()){
+            CompactOrders();
+        }
+        return --first_order_;
+    }
+    return AllocateLastOrder();
+}
+
+int Sheet::GetLastOrder() const{
+    return next_order_ - 1;
+}
+
+int Sheet::AllocateLastOrder(){
+    if(next_order_ == std::numeric_limits<int>::max()){
+        CompactOrders();
+    }
+    return next_order_++;
+}
+
+void Sheet::CompactOrders(){
+    std::vector<Cell*> cells;
+    cells.reserve(cells_.GetCellCount());
+    cells_.ForEach([&cells](Position, Cell& cell){
+        cells.push_back(&cell);
+    });
+    std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs){
+        return lhs->GetOrder() < rhs->GetOrder();
+    });
+    for(size_t i = 0; i < cells.size(); ++i){
+        cells[i]->SetOrder(static_cast<int>(i));
+    }
+    first_order_ = 0;
+    next_order_ = static_cast<int>(cells.size());
+}
+
+std::uint32_t Sheet::NewVisitMark(){
+    return ++visit_mark_;
+}
+
+SheetStats Sheet::GetStats() const{
+    return stats_.Collect();
+}
+
+StatsCollector& Sheet::GetStatsCollector(){
+    return stats_;
+}
+
+std::unique_ptr<FormulaInterface> Sheet::ParseCellFormula(std::string_view expression,
+                                                          Position pos){
+    StatsCollector::Counters& counters = stats_.Local();
+    const auto start = std::chrono::steady_clock::now();
+    // неудачный разбор тоже стоит времени
+    const auto count = [&counters, start](){
+        StatsCollector::Counters::Add(counters.parses, 1);
+        StatsCollector::Counters::Add(counters.parse_nanoseconds,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    };
+    try{
+        std::unique_ptr<FormulaInterface> formula = formula_pool_.Parse(expression, pos);
+        count();
+        return formula;
+    }
+    catch(...){
+        count();
+        throw;
+    }
+}
+
+FormulaPool& Sheet::GetFormulaPool(){
+    return formula_pool_;
+}
+
+TextPool& Sheet::GetTextPool(){
+    return text_pool_;
+}
+
+const TextPool& Sheet::GetTextPool() const{
+    return text_pool_;
+}
+
+RangeIndex& Sheet::GetRangeIndex(){
+    return range_index_;
+}
+
+const RangeIndex& Sheet::GetRangeIndex() const{
+    return range_index_;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
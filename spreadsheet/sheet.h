@@ -1,21 +1,31 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "range_index.h"
+#include "stats.h"
+#include "thread_pool.h"
 
 #include <functional>
-#include <unordered_map>
-#include <cmath>
+#include <optional>
+#include <ostream>
 #include <vector>
 
-using Cell_ptr = std::unique_ptr<Cell>;
+// Способ пересчёта значений в Sheet::Recalculate()
+enum class RecalcPolicy {
+    Sequential,  // в вызывающем потоке
+    Parallel,    // в пуле потоков таблицы
+};
 
-struct PositionHash {
-    size_t operator()(const Position& pos) const {
-        size_t hash_row = std::hash<int>{}(pos.row);
-        size_t hash_col = std::hash<int>{}(pos.col);
-        return hash_row ^ (hash_col << 1);
-    }
+// Способ сброса кешей при правке ячейки, см. Sheet::SetInvalidationMode()
+enum class InvalidationMode {
+    // правка сразу сбрасывает кеши всех ячеек, зависящих от правленой
+    Eager,
+    // правка только отмечает новую версию ячейки, а кеш формулы
+    // проверяется по версиям её входов, когда значение понадобится;
+    // формула, вычисленная заново с прежним значением, версию не меняет
+    Lazy,
 };
 
 class Sheet : public SheetInterface {
@@ -30,33 +40,233 @@ public:
     Size GetPrintableSize() const override;
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // Печатает значения области: строка листа на строку вывода, все столбцы
+    // области через табуляцию, у отсутствующих и пустых ячеек поля пусты.
+    // Вычисляются только ячейки области и те, от которых они зависят,
+    // поэтому стоимость определяется областью, а не размером листа.
+    // Некорректная область - InvalidPositionException.
+    void PrintValues(std::ostream& output, Rect range) const;
+    // Значения ячеек области по строкам: [row - top][col - left]. Значение
+    // отсутствующей ячейки - пустая строка, как у пустой ячейки. Вычисляет
+    // то же, что PrintValues() с областью.
+    std::vector<std::vector<CellInterface::Value>> GetValues(Rect range) const;
     Cell* GetOrCreateCell(Position pos);
+    // Возвращает ячейку по корректной позиции или nullptr, если её нет
+    const Cell* FindCell(Position pos) const;
+    Cell* FindCell(Position pos);
+
+    // Пакетная правка. Между BeginBatch() и CommitBatch() вызовы SetCell(),
+    // ClearCell() и ClearRange() только запоминаются, лист остаётся прежним.
+    // CommitBatch() применяет их разом: формулы разбираются заранее, на циклы
+    // проверяется весь набор правок, кеши зависимых ячеек сбрасываются
+    // одним проходом. Если пакет нельзя применить, CommitBatch() бросает
+    // FormulaException или CircularDependencyException, не меняя лист, и
+    // пакет отбрасывается. Из нескольких правок одной ячейки действует
+    // последняя. Пары BeginBatch()/CommitBatch() могут быть вложенными,
+    // правки применяются при закрытии внешней. CommitBatch() без открытого
+    // пакета бросает std::logic_error.
+    void BeginBatch();
+    void CommitBatch();
+    // Загружает тексты ячеек из файла в формате PrintTexts(): строка файла -
+    // строка листа, поля разделены separator. Пустые поля не меняют ячеек,
+    // кавычки и экранирование разделителей не поддерживаются. Файл
+    // отображается в память, большой файл разбирается кусками по строкам в
+    // пуле потоков, вместе с формулами. Затем все ячейки вставляются одним
+    // пакетом (см. CommitBatch()), поэтому граф зависимостей строится один
+    // раз. При ошибке лист не меняется. Внутри открытого пакета ячейки
+    // только добавляются к его правкам, а ошибки циклов бросает CommitBatch().
+    void LoadTexts(const std::string& path, char separator = '\t');
+    // Сохраняет лист в двоичный снимок: тексты ячеек, общие деревья формул
+    // вместе со скомпилированными программами, топологический порядок и
+    // вычисленные значения. Правки открытого пакета не сохраняются. Бросает
+    // SnapshotError, если файл не удалось записать.
+    void SaveSnapshot(const std::string& path) const;
+    // Лист из снимка SaveSnapshot(). Формулы не разбираются и не
+    // компилируются, порядок ячеек берётся готовым и только сверяется со
+    // ссылками формул (входы раньше формулы, так что циклов нет), вычисленные
+    // значения сразу попадают в кеш. Файл отображается
+    // в память, ячейки строятся прямо из него. Бросает std::system_error,
+    // если файл не открылся, и SnapshotError, если снимок повреждён или
+    // записан другой версией.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
+    // Задаёт ячейки одним пакетом
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+    // Очищает все ячейки области одним пакетом
+    void ClearRange(Rect range);
+
+    // Вычисляет значения всех ячеек, чей кеш сброшен. Каждая ячейка
+    // вычисляется ровно один раз и после всех ячеек, от которых она зависит,
+    // поэтому вычисление идёт без рекурсии. Без вызова Recalculate() значения
+    // по-прежнему вычисляются лениво при обращении к ним.
+    // В режиме Parallel независимые ячейки считаются в пуле потоков,
+    // результат совпадает с последовательным пересчётом.
+    void Recalculate(RecalcPolicy policy = RecalcPolicy::Sequential);
+    // Запоминает ячейку со сброшенным кешем для следующего Recalculate()
+    void MarkDirty(Cell* cell);
+    // Запоминает ячейку, изменённую в режиме Lazy, для следующего
+    // распространения правок
+    void MarkChanged(const Cell* cell);
+
+    // Задаёт способ сброса кешей. По умолчанию Eager: правка обходит всех
+    // зависимых ячеек и сбрасывает их кеши. В режиме Lazy правка стоит O(1):
+    // у ячейки меняется версия, а формула при чтении сначала проверяет
+    // свои входы и вычисляется заново, только если какой-то из них изменился
+    // после прошлой проверки. Это выгодно, когда часто правится ячейка, от
+    // которой зависит много формул, а читается лишь часть из них.
+    // Recalculate() в режиме Lazy распространяет правки в вызывающем
+    // потоке: от изменённых ячеек по зависимым в топологическом порядке.
+    // Формула вычисляется заново, только если изменился какой-то из её
+    // входов, и если её значение осталось прежним, её зависимые дальше не
+    // проверяются (раннее отсечение). Правка текста, не меняющая его числа,
+    // не сбрасывает кешей ни в одном режиме, кроме пакета в режиме Eager:
+    // он сбрасывает кеши зависимых всех своих ячеек. Смена режима обходит
+    // все ячейки листа.
+    void SetInvalidationMode(InvalidationMode mode);
+    InvalidationMode GetInvalidationMode() const;
+    // Версия листа: растёт с каждым изменением содержимого ячейки
+    std::uint64_t GetRevision() const;
+    // Начинает новую версию листа и возвращает её
+    std::uint64_t AdvanceRevision();
+    // Версия листа, до которой правки распространены по зависимым ячейкам
+    // в режиме Lazy: если она текущая, все кеши формул верны
+    std::uint64_t GetPropagatedRevision() const;
+
+    // Номер для новой ячейки в топологическом порядке. Она ещё ни от чего не
+    // зависит, поэтому ставится в конец, а если на неё уже смотрит диапазон
+    // какой-то формулы - в начало.
+    int AllocateOrder(Position pos);
+    // Номер после всех уже выданных
+    int AllocateLastOrder();
+    // Перенумеровывает ячейки подряд с нуля, сохраняя их порядок. Номера не
+    // переиспользуются, а пакет правок переносит в конец всех зависимых
+    // правленых ячеек, поэтому на долгоживущем листе счётчики доходят до
+    // границ int; тогда номера выдаются заново через эту перенумерацию.
+    void CompactOrders();
+    // Наибольший номер в топологическом порядке
+    int GetLastOrder() const;
+    // Новая отметка для обхода графа ячеек: ячейка считается посещённой,
+    // если её отметка совпадает с текущей
+    std::uint32_t NewVisitMark();
+
+    // Счётчики работы листа с момента создания: обращения к кешу,
+    // вычисления, сбросы кешей, проверки циклов, разбор формул и текущее
+    // число рёбер графа. Счётчики ведутся всегда и стоят одного сложения
+    // в блоке вызывающего потока; GetStats() складывает блоки всех потоков.
+    SheetStats GetStats() const;
+    StatsCollector& GetStatsCollector();
+    // Разбирает формулу ячейки pos через пул формул, учитывая разбор в
+    // счётчиках. Бросает то же, что FormulaPool::Parse().
+    std::unique_ptr<FormulaInterface> ParseCellFormula(std::string_view expression, Position pos);
+
+    // Общие для ячеек листа скомпилированные формулы
+    FormulaPool& GetFormulaPool();
+    // Тексты ячеек листа без повторов
+    TextPool& GetTextPool();
+    const TextPool& GetTextPool() const;
+    // Диапазоны из формул листа
+    RangeIndex& GetRangeIndex();
+    const RangeIndex& GetRangeIndex() const;
+
+    // Вызывает f(Position, const Cell&) для существующих ячеек диапазона
+    template <typename F>
+    void ForEachCellInRect(Rect range, F f) const;
 
 private:
-    std::unordered_map<Position, Cell_ptr, PositionHash> cells_;
+    static constexpr size_t MIN_PARALLEL_PLAN_SIZE = 1024;
+    // файлы меньше этого размера загружаются в одном потоке
+    static constexpr size_t MIN_PARALLEL_LOAD_SIZE = 1 << 20;
+    // листы с меньшим числом ячеек печатаются в одном потоке
+    static constexpr size_t MIN_PARALLEL_PRINT_SIZE = 1 << 16;
+    // примерное число ячеек в куске строк, который форматируется в один буфер
+    static constexpr size_t PRINT_CHUNK_CELLS = 1 << 16;
+
+    StatsCollector stats_;
+    // ячейки держат ссылки на тексты пула, поэтому он объявлен раньше них
+    TextPool text_pool_;
+    CellStorage cells_;
+    FormulaPool formula_pool_;
+    RangeIndex range_index_;
     mutable Size printable_size_;
     std::vector<int> rows_count_;
     std::vector<int> cols_count_;
-    
-    struct CellValuePrinter {
-        std::string operator()(double value) const {
-            double int_check;
-            if(std::modf(value, &int_check) == 0.0){
-                return std::to_string(int(value));
-            }else{
-               return std::to_string(value); 
-            }
-        }
-        std::string operator()(const std::string& value) const {
-            return value;
-        }
-        std::string operator()(const FormulaError& value) const {
-            return std::string{value.ToString()};
-        }
-        
+    // ячейки со сброшенным кешем; их вычисление в константных PrintValues()
+    // тоже забывает их
+    mutable FlatHashSet<Cell*> dirty_cells_;
+    int next_order_ = 0;
+    int first_order_ = 0;
+    std::uint32_t visit_mark_ = 0;
+    int batch_depth_ = 0;
+    InvalidationMode invalidation_mode_ = InvalidationMode::Eager;
+    std::uint64_t revision_ = 0;
+    // ячейки, изменённые в режиме Lazy после последнего распространения правок
+    mutable FlatHashSet<const Cell*> changed_cells_;
+    mutable std::uint64_t propagated_revision_ = 0;
+    struct PendingEdit {
+        Position pos;
+        // nullopt - очистка ячейки
+        std::optional<std::string> text;
+        // формула, разобранная заранее
+        std::unique_ptr<FormulaInterface> formula = nullptr;
     };
-
+    // правки открытого пакета
+    std::vector<PendingEdit> batch_;
+    // создаётся при первом параллельном пересчёте, загрузке или печати
+    mutable std::unique_ptr<ThreadPool> thread_pool_;
+    
     bool IsValid(Position pos) const;
     void RefreshPrintableSize() const;
     void TestPosition(Position pos) const;
+    // Применяет правки как один пакет, см. CommitBatch()
+    void ApplyEdits(std::vector<PendingEdit> edits);
+    ThreadPool& GetThreadPool() const;
+    // Вычисляет ячейки со сброшенным кешем в топологическом порядке и
+    // забывает их, как Recalculate(): кеш заполняется так же, как при
+    // ленивом вычислении
+    void EvaluateDirtyCells() const;
+    // Распространяет правки режима Lazy, см. SetInvalidationMode()
+    void PropagateChanges() const;
+    // Вычисляет ячейки области и все невычисленные ячейки, от которых они
+    // зависят, в топологическом порядке. Другие ячейки не затрагиваются.
+    void EvaluateRange(Rect range) const;
+    // учитывают ячейку в размере печатной области
+    void CountCell(Position pos);
+    void UncountCell(Position pos);
+
+    // Печатает область печати построчно, format(const Cell&, std::string&)
+    // дописывает содержимое ячейки в буфер и может вызываться из
+    // нескольких потоков сразу
+    template <typename Format>
+    void PrintCells(std::ostream& output, Format format) const;
 };
+
+template <typename F>
+void Sheet::ForEachCellInRect(Rect range, F f) const {
+    cells_.ForEachInRect(range, [&f](Position pos, const Cell& cell) {
+        f(pos, cell);
+    });
+}
+
+template <typename F>
+void Cell::ForEachInput(F f) const {
+    if (!links_) {
+        return;
+    }
+    for (Cell* input : links_->referenced_by) {
+        f(input);
+    }
+    for (Rect range : links_->referenced_ranges) {
+        sheet_.ForEachCellInRect(range, [&f](Position, const Cell& input) {
+            f(const_cast<Cell*>(&input));
+        });
+    }
+}
+
+template <typename F>
+void Cell::ForEachDependent(F f) const {
+    if (links_) {
+        for (Cell* dependent : links_->reference_to) {
+            f(dependent);
+        }
+    }
+    sheet_.GetRangeIndex().ForEachCovering(pos_, f);
+}
@@ -0,0 +1,38 @@
+#include "snapshot.h"
+
+void SnapshotWriter::WriteString(std::string_view text) {
+    Write(static_cast<std::uint32_t>(text.size()));
+    data_.append(text);
+}
+
+const std::string& SnapshotWriter::GetData() const {
+    return data_;
+}
+
+SnapshotReader::SnapshotReader(std::string_view data)
+    : data_(data) {}
+
+std::string_view SnapshotReader::ReadString() {
+    return ReadBytes(Read<std::uint32_t>());
+}
+
+std::string_view SnapshotReader::ReadBytes(size_t size) {
+    if (size > data_.size()) {
+        throw SnapshotError("snapshot is truncated");
+    }
+    std::string_view bytes = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return bytes;
+}
+
+size_t SnapshotReader::ReadCount(size_t min_size) {
+    const auto count = Read<std::uint64_t>();
+    if (min_size != 0 && count > data_.size() / min_size) {
+        throw SnapshotError("snapshot is truncated");
+    }
+    return static_cast<size_t>(count);
+}
+
+bool SnapshotReader::AtEnd() const {
+    return data_.empty();
+}
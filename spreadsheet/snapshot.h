@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Ошибка чтения или записи снимка листа: снимок повреждён, записан
+// несовместимой версией или файл не удалось записать
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичная запись снимка. Числа пишутся в порядке байт машины, порядок
+// проверяется по метке в заголовке снимка. Ссылок на адреса в снимке нет,
+// только размеры и номера, поэтому его можно читать прямо из отображённого
+// в память файла.
+class SnapshotWriter {
+public:
+    template <typename T>
+    void Write(T value) {
+        static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+        data_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // строка с длиной впереди
+    void WriteString(std::string_view text);
+
+    const std::string& GetData() const;
+
+private:
+    std::string data_;
+};
+
+// Чтение снимка с проверкой границ: выход за конец данных бросает
+// SnapshotError
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data);
+
+    template <typename T>
+    T Read() {
+        static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+        T value;
+        std::memcpy(&value, ReadBytes(sizeof(value)).data(), sizeof(value));
+        return value;
+    }
+
+    std::string_view ReadString();
+    std::string_view ReadBytes(size_t size);
+
+    // Число элементов, под которые в данных есть хотя бы min_size байт на
+    // каждый. Защищает от огромных выделений памяти по испорченному счётчику.
+    size_t ReadCount(size_t min_size);
+
+    bool AtEnd() const;
+
+private:
+    std::string_view data_;
+};
@@ -0,0 +1,85 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+std::atomic<std::uint64_t> next_collector_id{1};
+
+// Блоки потока в сборщиках, к которым он обращался, по номерам сборщиков.
+// Номер сборщика определяет ячейку кеша, так что поток, работающий с
+// несколькими листами попеременно, находит блок каждого без блокировки.
+// Номера не повторяются, поэтому ячейка удалённого сборщика просто
+// перезаписывается следующим.
+struct LocalCounters {
+    std::uint64_t collector_id = 0;
+    StatsCollector::Counters* counters = nullptr;
+};
+constexpr size_t LOCAL_CACHE_SIZE = 16;
+thread_local std::array<LocalCounters, LOCAL_CACHE_SIZE> local_counters;
+
+size_t InvalidationBucket(std::uint64_t cells) {
+    size_t bucket = 0;
+    for (; cells != 0; cells >>= 1) {
+        ++bucket;
+    }
+    return std::min(bucket, SheetStats::INVALIDATION_BUCKETS - 1);
+}
+}  // namespace
+
+StatsCollector::StatsCollector()
+    : id_(next_collector_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+StatsCollector::Counters& StatsCollector::Local() {
+    LocalCounters& cached = local_counters[id_ % LOCAL_CACHE_SIZE];
+    if (cached.collector_id == id_) {
+        return *cached.counters;
+    }
+
+    const std::thread::id thread = std::this_thread::get_id();
+    std::lock_guard lock(mutex_);
+    auto it = std::find_if(counters_.begin(), counters_.end(), [thread](const auto& counters) {
+        return counters->owner_ == thread;
+    });
+    if (it == counters_.end()) {
+        counters_.push_back(std::make_unique<Counters>());
+        counters_.back()->owner_ = thread;
+        it = std::prev(counters_.end());
+    }
+    cached = {id_, it->get()};
+    return **it;
+}
+
+void StatsCollector::AddInvalidation(std::uint64_t cells) {
+    Counters& counters = Local();
+    Counters::Add(counters.invalidated_cells, cells);
+    Counters::Add(counters.invalidation_histogram[InvalidationBucket(cells)], 1);
+}
+
+SheetStats StatsCollector::Collect() const {
+    const auto load = [](const auto& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    SheetStats stats;
+    std::lock_guard lock(mutex_);
+    for (const auto& counters : counters_) {
+        stats.cache_hits += load(counters->cache_hits);
+        stats.cache_misses += load(counters->cache_misses);
+        stats.evaluations += load(counters->evaluations);
+        stats.cache_validations += load(counters->cache_validations);
+        stats.cutoffs += load(counters->cutoffs);
+        stats.invalidated_cells += load(counters->invalidated_cells);
+        for (size_t i = 0; i < SheetStats::INVALIDATION_BUCKETS; ++i) {
+            const std::uint64_t passes = load(counters->invalidation_histogram[i]);
+            stats.invalidation_histogram[i] += passes;
+            stats.invalidation_passes += passes;
+        }
+        stats.cycle_checks += load(counters->cycle_checks);
+        stats.cycle_check_visits += load(counters->cycle_check_visits);
+        stats.parses += load(counters->parses);
+        stats.parse_time += std::chrono::nanoseconds(load(counters->parse_nanoseconds));
+        stats.cell_edges += load(counters->cell_edges);
+        stats.range_edges += load(counters->range_edges);
+    }
+    return stats;
+}
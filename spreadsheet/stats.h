@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Счётчики работы листа, см. Sheet::GetStats()
+struct SheetStats {
+    // Корзина i гистограммы сбросов считает проходы, сбросившие от 2^(i-1)
+    // до 2^i - 1 кешей, корзина 0 - проходы, не сбросившие ни одного
+    static constexpr size_t INVALIDATION_BUCKETS = 30;
+
+    // вызовы GetValue(), ответ на которые уже был в кеше
+    std::uint64_t cache_hits = 0;
+    // вызовы GetValue(), потребовавшие вычисления
+    std::uint64_t cache_misses = 0;
+    // вычисленные формулы, в том числе входы при ленивом вычислении и
+    // ячейки Recalculate()
+    std::uint64_t evaluations = 0;
+    // кеши, подтверждённые по версиям входов при ленивом сбросе, см.
+    // InvalidationMode::Lazy
+    std::uint64_t cache_validations = 0;
+    // раннее отсечение: формулы, вычисленные заново с прежним значением, и
+    // правки текста, не изменившие его значения для зависимых ячеек и
+    // потому не сбросившие их кешей
+    std::uint64_t cutoffs = 0;
+
+    // проходы сброса кешей: правка ячейки или пакет правок
+    std::uint64_t invalidation_passes = 0;
+    // сброшенные кеши за все проходы
+    std::uint64_t invalidated_cells = 0;
+    std::array<std::uint64_t, INVALIDATION_BUCKETS> invalidation_histogram{};
+
+    // проверки новых ссылок на циклы и ячейки, пройденные ими
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_visits = 0;
+
+    // разобранные формулы ячеек и суммарное время разбора
+    std::uint64_t parses = 0;
+    std::chrono::nanoseconds parse_time{0};
+
+    // рёбра графа сейчас: ссылки формул на ячейки и диапазоны в формулах
+    std::int64_t cell_edges = 0;
+    std::int64_t range_edges = 0;
+};
+
+// Сборщик счётчиков листа. У каждого потока свой блок счётчиков, который
+// пишет только он сам, без блокировок и без общих строк кеша; при чтении
+// блоки всех потоков складываются. Поэтому счётчики можно не отключать и
+// при параллельном пересчёте или загрузке.
+class StatsCollector {
+public:
+    class alignas(64) Counters {
+    public:
+        // Прибавляет к счётчику потока. Вызывается только потоком-владельцем.
+        template <typename T, typename U>
+        static void Add(std::atomic<T>& counter, U value) {
+            counter.store(counter.load(std::memory_order_relaxed) + static_cast<T>(value),
+                          std::memory_order_relaxed);
+        }
+
+        std::atomic<std::uint64_t> cache_hits{0};
+        std::atomic<std::uint64_t> cache_misses{0};
+        std::atomic<std::uint64_t> evaluations{0};
+        std::atomic<std::uint64_t> cache_validations{0};
+        std::atomic<std::uint64_t> cutoffs{0};
+        std::atomic<std::uint64_t> invalidated_cells{0};
+        std::array<std::atomic<std::uint64_t>, SheetStats::INVALIDATION_BUCKETS>
+            invalidation_histogram{};
+        std::atomic<std::uint64_t> cycle_checks{0};
+        std::atomic<std::uint64_t> cycle_check_visits{0};
+        std::atomic<std::uint64_t> parses{0};
+        std::atomic<std::int64_t> parse_nanoseconds{0};
+        // изменения числа рёбер, сделанные потоком
+        std::atomic<std::int64_t> cell_edges{0};
+        std::atomic<std::int64_t> range_edges{0};
+
+    private:
+        friend class StatsCollector;
+
+        std::thread::id owner_;
+    };
+
+    StatsCollector();
+
+    StatsCollector(const StatsCollector&) = delete;
+    StatsCollector& operator=(const StatsCollector&) = delete;
+
+    // Счётчики вызывающего потока
+    Counters& Local();
+
+    // Учитывает проход сброса кешей, сбросивший cells кешей
+    void AddInvalidation(std::uint64_t cells);
+
+    // Сумма счётчиков всех потоков
+    SheetStats Collect() const;
+
+private:
+    // номер сборщика, по которому поток узнаёт свой блок в кеше потока
+    const std::uint64_t id_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Counters>> counters_;
+};
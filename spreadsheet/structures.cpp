@@ -1,8 +1,9 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -59,8 +60,9 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const char* digits_end = digits.data() + digits.size();
+    auto [ptr, ec] = std::from_chars(digits.data(), digits_end, row);
+    if (ec != std::errc() || ptr != digits_end) {
         return Position::NONE;
     }
 
@@ -75,4 +77,34 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Rect::operator==(Rect rhs) const {
+    return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+}
+
+bool Rect::operator<(Rect rhs) const {
+    return std::tie(top_left, bottom_right) < std::tie(rhs.top_left, rhs.bottom_right);
+}
+
+bool Rect::IsValid() const {
+    return top_left.IsValid() && bottom_right.IsValid() && top_left.row <= bottom_right.row
+           && top_left.col <= bottom_right.col;
+}
+
+bool Rect::Contains(Position pos) const {
+    return top_left.row <= pos.row && pos.row <= bottom_right.row && top_left.col <= pos.col
+           && pos.col <= bottom_right.col;
+}
+
+std::string Rect::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return top_left.ToString() + ':' + bottom_right.ToString();
+}
+
+Rect Rect::FromCorners(Position a, Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+            {std::max(a.row, b.row), std::max(a.col, b.col)}};
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "text_pool.h"
+#include "formula.h"
+
+#include <cassert>
+#include <utility>
+
+TextPool::Ref::Ref(Entry* entry)
+    : entry_(entry) {
+    ++entry_->refs;
+}
+
+TextPool::Ref::~Ref() {
+    if (entry_ != nullptr) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+TextPool::Ref::Ref(Ref&& other) noexcept
+    : entry_(std::exchange(other.entry_, nullptr)) {}
+
+TextPool::Ref& TextPool::Ref::operator=(Ref&& other) noexcept {
+    if (this != &other) {
+        if (entry_ != nullptr) {
+            entry_->pool->Release(entry_);
+        }
+        entry_ = std::exchange(other.entry_, nullptr);
+    }
+    return *this;
+}
+
+const CellInterface::Value& TextPool::Ref::GetValue() const {
+    return entry_->value;
+}
+
+const std::string& TextPool::Ref::GetText() const {
+    return std::get<std::string>(entry_->value);
+}
+
+const std::optional<double>& TextPool::Ref::GetNumber() const {
+    return entry_->number;
+}
+
+TextPool::TextPool() = default;
+
+TextPool::~TextPool() {
+    assert(entries_.empty());
+}
+
+TextPool::Ref TextPool::Intern(std::string_view text) {
+    auto it = entries_.find(text);
+    if (it == entries_.end()) {
+        auto entry = std::make_unique<Entry>(Entry{std::string(text), ParseTextNumber(text), 0, this});
+        const std::string_view key = std::get<std::string>(entry->value);
+        it = entries_.emplace(key, std::move(entry)).first;
+    }
+    return Ref(it->second.get());
+}
+
+size_t TextPool::GetSize() const {
+    return entries_.size();
+}
+
+void TextPool::Release(Entry* entry) {
+    if (--entry->refs == 0) {
+        // ключ указывает в саму запись, поэтому удаление идёт по итератору
+        entries_.erase(entries_.find(std::get<std::string>(entry->value)));
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Тексты ячеек листа без повторов. Одинаковые тексты хранятся один раз, а
+// ячейки держат на них ссылки Ref размером в указатель. Текст лежит в
+// записи пула готовым значением ячейки, поэтому значение отдаётся ссылкой,
+// без копирования строки. Число, которое записано текстом, разбирается
+// один раз при добавлении текста в пул. Запись удаляется, когда на неё не
+// остаётся ссылок. Пул должен жить дольше всех своих ссылок.
+class TextPool {
+    struct Entry;
+
+public:
+    // Ссылка на текст пула, владеющая им наравне с остальными ссылками
+    class Ref {
+    public:
+        Ref() = default;
+        ~Ref();
+
+        Ref(Ref&& other) noexcept;
+        Ref& operator=(Ref&& other) noexcept;
+
+        Ref(const Ref&) = delete;
+        Ref& operator=(const Ref&) = delete;
+
+        explicit operator bool() const {
+            return entry_ != nullptr;
+        }
+
+        // Значение, в котором лежит текст, std::string
+        const CellInterface::Value& GetValue() const;
+        const std::string& GetText() const;
+        // Текст как число, см. ParseTextNumber(). nullopt, если текст не
+        // число или пуст.
+        const std::optional<double>& GetNumber() const;
+
+    private:
+        friend class TextPool;
+
+        explicit Ref(Entry* entry);
+
+        Entry* entry_ = nullptr;
+    };
+
+    TextPool();
+    ~TextPool();
+
+    TextPool(const TextPool&) = delete;
+    TextPool& operator=(const TextPool&) = delete;
+
+    Ref Intern(std::string_view text);
+
+    // число различных текстов
+    size_t GetSize() const;
+
+private:
+    struct Entry {
+        CellInterface::Value value;
+        std::optional<double> number;
+        size_t refs = 0;
+        TextPool* pool;
+    };
+
+    // ключ указывает на строку в значении записи
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries_;
+
+    void Release(Entry* entry);
+};
@@ -0,0 +1,127 @@
+#include "thread_pool.h"
+
+#include <utility>
+
+namespace {
+// пул и номер очереди текущего рабочего потока
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_queue = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(state_mutex_);
+        stop_ = true;
+    }
+    work_available_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return workers_.size();
+}
+
+void ThreadPool::Submit(Task task) {
+    size_t index = current_pool == this
+        ? current_queue
+        : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+
+    active_.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    queued_.fetch_add(1, std::memory_order_release);
+
+    // пустой захват мьютекса не даёт уснувшему потоку пропустить уведомление
+    { std::lock_guard lock(state_mutex_); }
+    work_available_.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock lock(state_mutex_);
+    all_done_.wait(lock, [this] {
+        return active_.load(std::memory_order_acquire) == 0;
+    });
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    current_pool = this;
+    current_queue = index;
+
+    Task task;
+    while (true) {
+        if (PopLocal(index, task) || Steal(index, task)) {
+            Run(task);
+            continue;
+        }
+
+        std::unique_lock lock(state_mutex_);
+        work_available_.wait(lock, [this] {
+            return stop_ || queued_.load(std::memory_order_acquire) > 0;
+        });
+        if (stop_ && queued_.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::PopLocal(size_t index, Task& task) {
+    Queue& queue = *queues_[index];
+    std::lock_guard lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ThreadPool::Steal(size_t thief, Task& task) {
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        Queue& queue = *queues_[(thief + i) % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::Run(Task& task) {
+    try {
+        task();
+    } catch (...) {
+        std::lock_guard lock(state_mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+    task = nullptr;
+
+    if (active_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        { std::lock_guard lock(state_mutex_); }
+        all_done_.notify_all();
+    }
+}
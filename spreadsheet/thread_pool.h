@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы. У каждого рабочего потока своя очередь:
+// задачи, поставленные из рабочего потока, попадают в его очередь и берутся
+// оттуда в обратном порядке (последняя поставленная - первой), а простаивающие
+// потоки забирают задачи с другого конца чужих очередей.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const;
+
+    void Submit(Task task);
+
+    // Ждёт выполнения всех поставленных задач, включая порождённые ими.
+    // Если какая-то задача бросила исключение, бросает первое из них.
+    void Wait();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    // задачи, лежащие в очередях
+    std::atomic<size_t> queued_ = 0;
+    // задачи, поставленные, но ещё не выполненные
+    std::atomic<size_t> active_ = 0;
+    std::atomic<size_t> next_queue_ = 0;
+
+    std::mutex state_mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable all_done_;
+    bool stop_ = false;
+    std::exception_ptr error_;
+
+    void WorkerLoop(size_t index);
+    bool PopLocal(size_t index, Task& task);
+    bool Steal(size_t thief, Task& task);
+    void Run(Task& task);
+};